@@ -0,0 +1,84 @@
+#include "xmlparser.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+// Throughput of parsing, serialization, copying and destruction of element trees. Shallow documents show the cost of
+// walking the tree without recursion, the deep one shows that nesting is limited by memory only.
+
+namespace {
+
+// Wide and shallow: 'count' items with a few attributes and children each
+std::string MakeShallow(std::size_t count)
+{
+   std::string text = "<catalog>";
+   for (std::size_t i = 0; i < count; ++i) {
+      std::string id = std::to_string(i);
+      text += "<item id=\"" + id + "\" type=\"book\"><name>Item " + id + "</name><price>9.99</price>";
+      text += "<tags><tag>a</tag><tag>b &amp; c</tag></tags></item>";
+   }
+   return text + "</catalog>";
+}
+
+// A single chain of 'depth' nested elements
+std::string MakeDeep(std::size_t depth)
+{
+   std::string text;
+   for (std::size_t i = 0; i < depth; ++i)
+      text += "<node>";
+   text += "leaf";
+   for (std::size_t i = 0; i < depth; ++i)
+      text += "</node>";
+   return text;
+}
+
+// Runs 'func' 'repeat' times and prints the throughput for 'bytes' of xml per run
+template <typename TFunc>
+void Measure(const char *name, std::size_t bytes, int repeat, TFunc &&func)
+{
+   auto start = std::chrono::steady_clock::now();
+   for (int i = 0; i < repeat; ++i)
+      func();
+   std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+   std::cout << name << ": " << static_cast<double>(bytes) * repeat / elapsed.count() / (1 << 20) << " MB/s"
+             << std::endl;
+}
+
+void Run(const char *title, const std::string &text, int repeat)
+{
+   std::cout << title << ", " << text.size() << " bytes" << std::endl;
+
+   auto doc = xml::ParseString(text.c_str());
+   std::string out;
+   Measure("   ToString", text.size(), repeat, [&]() { doc->ToString(out); });
+   Measure("   Parse and destroy", text.size(), repeat, [&]() { xml::ParseString(text.c_str()); });
+   Measure("   Copy and destroy", text.size(), repeat, [&]() { doc->Copy(); });
+   Measure("   Canonical", text.size(), repeat, [&]() { doc->ToCanonicalString(); });
+   Measure("   Binary", text.size(), repeat, [&]() { doc->ToBinary(out); });
+
+   // Decoding is timed per byte of xml, so that it compares with parsing
+   std::string binary = doc->ToBinary();
+   Measure("   Decode binary", text.size(), repeat, [&]() { xml::ParseBinary<char>(binary); });
+   std::cout << "   Binary size: " << binary.size() << " bytes, " << static_cast<double>(text.size()) / binary.size()
+             << "x smaller" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+   // Usage: xmlbench [repeat] [depth], a depth of 0 skips the deep document
+   int repeat        = argc > 1 ? std::atoi(argv[1]) : 10;
+   std::size_t depth = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 100000;
+   try {
+      Run("Shallow", MakeShallow(50000), repeat);
+      if (depth > 0)
+         Run("Deep", MakeDeep(depth), repeat);
+   }
+   catch (const xml::Exception &e) {
+      std::cout << e.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
@@ -1,7 +1,9 @@
 #include "xmlparser.hpp"
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <chrono>
+#include <cstdio>
 
 #define UNICODE
 
@@ -53,6 +55,10 @@ void TestParseStringAndCopy(const char_t *text)
    auto root = doc->GetRoot();
    STDOUT << root.GetName() << std::endl;
 
+   auto topping = root.GetChild(_T("item")).GetChild(9);
+   STDOUT << topping.GetNamePrefixView() << _T(" ") << topping.GetNamePostfixView() << _T(" ")
+          << topping.GetAttributeValue(_T("nm:id")) << std::endl;
+
    auto doc_copy = doc->Copy();
    STDOUT << doc->ToString() << std::endl;
 }
@@ -72,16 +78,325 @@ void TestNewDocument()
    child3.AddAttribute(_T("last"), _T("False"));
    auto child4 = root.AddChild(_T("last"));
    child4.AddAttribute(_T("last"), _T("True"));
+   child4.AddAttribute(_T("quoted"), _T("\"a\" & <b>"));
    STDOUT << doc->ToString() << std::endl;
 
    root.SetContent(_T("illegal content")); // should throw
 }
 
+void TestToStringBuffer(const char_t *text)
+{
+   auto doc = xml::ParseString(text);
+
+   std::basic_string<char_t> buffer;
+   doc->ToString(buffer);
+   const char_t *data = buffer.data();
+   doc->ToString(buffer);
+   STDOUT << _T("Same output: ") << (buffer == doc->ToString()) << _T(", buffer reused: ") << (data == buffer.data())
+          << std::endl;
+
+   xml::WriteOptions options;
+   options.threads           = 4;
+   options.parallel_min_size = 0;
+   STDOUT << _T("Same parallel output: ") << (doc->ToString(options) == buffer) << std::endl;
+}
+
+void TestParallelToString()
+{
+   // Large enough to be split into many tasks of at least 64K symbols each
+   std::basic_ostringstream<char_t> generated;
+   generated << _T("<catalog>");
+   for (int i = 0; i < 20000; ++i)
+      generated << _T("<item id=\"") << i << _T("\" type=\"a &amp; b\">  <name>Item ") << i
+                << _T("</name><price>9.99</price></item>\n");
+   generated << _T("</catalog>");
+
+   // Added elements are written, the others are copied from the source
+   xml::ParseOptions parse_options;
+   parse_options.keep_source = true;
+   xml::Document<char_t> doc(generated.str().c_str(), parse_options);
+   for (std::size_t i = 0; i < 20000; i += 997)
+      doc.GetRoot().AddChild(i, _T("added")).AddAttribute(_T("value"), _T("<new>"));
+
+   xml::WriteOptions options;
+   options.threads = 4;
+   STDOUT << _T("Size: ") << doc.SerializedSize() << _T(", same parallel output: ")
+          << (doc.ToString(options) == doc.ToString()) << std::endl;
+}
+
+void TestWriteToStream()
+{
+   auto doc = xml::ParseString(_T("<?xml version=\"1.0\"?><list><entry key=\"a &amp; b\">1 &lt; 2</entry></list>"));
+   doc->WriteTo(STDOUT);
+   STDOUT << std::endl;
+   STDOUT << _T("Serialized size: ") << doc->SerializedSize() << _T(", root: ") << doc->GetRoot().SerializedSize()
+          << std::endl;
+}
+
+void TestPrettyPrint()
+{
+   auto doc = xml::ParseString(_T("<?xml version=\"1.0\"?><config><server host=\"localhost\" port=\"80\">")
+                               _T("<path>/</path></server><empty/></config>"));
+
+   xml::WriteOptions options;
+   options.pretty = true;
+   STDOUT << doc->ToString(options) << std::endl;
+
+   options.indent_width    = 2;
+   options.wrap_attributes = true;
+   doc->WriteTo(STDOUT, options);
+   STDOUT << std::endl;
+}
+
+void TestWriter()
+{
+   std::basic_string<char_t> out;
+   {
+      xml::StringSink<char_t> sink(&out);
+      xml::Writer<char_t> writer(&sink);
+      writer.Declaration(_T("1.0"), _T("UTF-8"));
+      writer.StartElement(_T("response"));
+      writer.Attribute(_T("status"), _T("ok"));
+      const char_t *values[] = {_T("1"), _T("x < y"), _T("\"quoted\"")};
+      for (const char_t *value : values) {
+         writer.StartElement(_T("value"));
+         writer.Attribute(_T("raw"), value);
+         writer.Text(value);
+         writer.EndElement();
+      }
+      writer.StartElement(_T("empty"));
+      writer.EndElement();
+      writer.EndElement();
+
+      try {
+         writer.StartElement(_T("second"));
+      }
+      catch (const xml::Exception &e) {
+         STDOUT << e.what() << std::endl;
+      }
+   }
+   STDOUT << out << std::endl;
+}
+
+void TestCanonical()
+{
+   auto doc1 = xml::ParseString(_T(R"(<?xml version="1.0"?>
+<r xmlns="urn:d" xmlns:b="urn:b" xmlns:a="urn:a"><e b:x="1" a:y="2" z="3"/><f xmlns:a="urn:a">a &gt; b</f></r>)"));
+   auto doc2 = xml::ParseString(_T(R"(<r xmlns:a="urn:a" xmlns:b="urn:b" xmlns="urn:d"><e z="3" a:y="2" b:x="1"></e>)")
+                                _T(R"(<f>a > b</f></r>)"));
+
+   STDOUT << doc1->ToCanonicalString() << std::endl;
+   STDOUT << _T("Same digest: ") << (doc1->CanonicalDigest() == doc2->CanonicalDigest()) << std::endl;
+}
+
+void TestElementToString(const char_t *text)
+{
+   auto doc = xml::ParseString(text);
+   STDOUT << doc->GetRoot().GetChild(_T("item")).GetChild(_T("batters")).ToString() << std::endl;
+
+   auto ns_doc = xml::ParseString(_T(R"(<r xmlns="urn:d" xmlns:a="urn:a"><a:e><f xmlns:a="urn:b">t</f></a:e></r>)"));
+   auto f      = ns_doc->GetRoot().GetChild(0).GetChild(0);
+   STDOUT << f.ToString() << std::endl;
+   f.WriteTo(STDOUT, true);
+   STDOUT << std::endl;
+
+#ifdef XMLPARSER_POSIX
+   // Namespace URIs this long are handed to writev() without copying, unless they are inherited
+   std::basic_string<char_t> uri(300, (char_t)'u');
+   auto long_doc   = xml::ParseString(_T("<r xmlns:p=\"") + uri + _T("\"><p:c>x</p:c></r>"));
+   auto c          = long_doc->GetRoot().GetChild(0);
+   std::FILE *file = std::tmpfile();
+   c.WriteTo(fileno(file), true);
+   std::rewind(file);
+   std::basic_string<char_t> written(c.ToString(true).size() + 1, (char_t)0);
+   written.resize(std::fread(&written[0], sizeof(char_t), written.size(), file));
+   std::fclose(file);
+   STDOUT << _T("Same through file descriptor: ") << (written == c.ToString(true)) << std::endl;
+#endif
+}
+
+// Replaces the last occurrence of 'from' in the file at 'path' by 'to' of the same length
+void PatchFile(const char *path, std::basic_string<char_t> from, std::basic_string<char_t> to)
+{
+   std::ifstream in(path, std::ios::binary);
+   std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+   in.close();
+   std::size_t pos = data.rfind(std::string(reinterpret_cast<const char *>(from.data()), from.size() * sizeof(char_t)));
+   data.replace(pos, to.size() * sizeof(char_t), reinterpret_cast<const char *>(to.data()), to.size() * sizeof(char_t));
+   std::ofstream(path, std::ios::binary).write(data.data(), data.size());
+}
+
+void TestSnapshot(const char_t *text)
+{
+   const char *path = "xmltests.snapshot";
+   xml::ParseString(text)->SaveSnapshot(path);
+   {
+      auto snapshot = xml::LoadSnapshot<char_t>(path);
+      auto item     = snapshot->GetRoot().GetChild(_T("item"));
+      STDOUT << item.GetAttributeValue(_T("type")) << _T(" ") << item.GetChild(_T("batters")).GetChild(2).GetContent()
+             << std::endl;
+   }
+
+   // Changed text is only detected by the checksum
+   PatchFile(path, _T("Cake"), _T("Bake"));
+   STDOUT << xml::LoadSnapshot<char_t>(path)->GetRoot().GetChild(_T("item")).GetChild(_T("name")).GetContent()
+          << std::endl;
+   try {
+      xml::LoadSnapshot<char_t>(path, true);
+   }
+   catch (const xml::Exception &e) {
+      STDOUT << e.what() << std::endl;
+   }
+
+   // Renaming "type" puts it in front of "id" on <item>, which binary search cannot handle
+   PatchFile(path, _T("type"), _T("aype"));
+   try {
+      xml::LoadSnapshot<char_t>(path);
+   }
+   catch (const xml::Exception &e) {
+      STDOUT << e.what() << std::endl;
+   }
+   std::remove(path);
+}
+
+void TestBinary(const char_t *text)
+{
+   auto doc     = xml::ParseString(text);
+   auto binary  = doc->ToBinary();
+   auto decoded = xml::ParseBinary<char_t>(binary);
+   STDOUT << _T("Binary size: ") << binary.size() << _T(", xml size: ") << doc->SerializedSize()
+          << _T(", same xml: ") << (decoded->ToString() == doc->ToString()) << std::endl;
+}
+
+void TestUtf8(const char_t *text)
+{
+   auto doc   = xml::ParseString(text);
+   auto name  = xml::ParseString(_T("<name>caf\u00E9</name>"));
+   auto bytes = name->ToUtf8();
+   STDOUT << _T("UTF-8 size: ") << bytes.size() << _T(", last symbol: ") << std::hex
+          << static_cast<unsigned>(static_cast<unsigned char>(bytes[9])) << _T(' ')
+          << static_cast<unsigned>(static_cast<unsigned char>(bytes[10])) << std::dec
+          << _T(", same size for ascii: ") << (doc->ToUtf8().size() == doc->SerializedSize()) << std::endl;
+}
+
+void TestKeepSource()
+{
+   xml::ParseOptions options;
+   options.keep_source = true;
+
+   xml::Document<char_t> doc(_T(R"(<config>
+   <!-- edited by hand -->
+   <server host='localhost'  port="80"/>
+   <client retries="3" />
+</config>)"),
+                             options);
+   doc.GetRoot().AddAttribute(_T("version"), _T("2"));
+   STDOUT << doc.ToString() << std::endl;
+
+   // '>' in attribute values doesn't end the tags copied from the source
+   xml::Document<char_t> quoted(_T("<r test=\"a > b\"><c note='>'/></r>"), options);
+   quoted.GetRoot().AddAttribute(_T("version"), _T("2"));
+   STDOUT << quoted.ToString() << _T(", exact size: ") << (quoted.SerializedSize() == quoted.ToString().size())
+          << std::endl;
+}
+
+void TestSharedStrings(const char_t *text)
+{
+   xml::ParseOptions options;
+   options.intern_strings = true;
+
+   auto doc1 = xml::ParseString(text, options);
+   auto doc2 = xml::ParseString(text, options);
+
+   auto item1 = doc1->GetRoot().GetChild(_T("item"));
+   auto item2 = doc2->GetRoot().GetChild(_T("item"));
+   bool shared_name  = &item1.GetName() == &item2.GetName();
+   bool shared_value = &item1.GetAttributeValue(_T("type")) == &item2.GetAttributeValue(_T("type"));
+   STDOUT << _T("Shared name: ") << shared_name << _T(", shared value: ") << shared_value << std::endl;
+}
+
+void TestGenericSpaces()
+{
+   // char16_t has no standard classification function, so it uses the generic details::IsSpace()
+   auto doc  = xml::ParseString(u"<a x=\"1\" y=\"2\"><b /> </a>");
+   auto root = doc->GetRoot();
+   STDOUT << _T("Name size: ") << root.GetName().size() << _T(", attributes: ") << root.GetAttributeCount()
+          << _T(", children: ") << root.GetChildCount() << std::endl;
+}
+
+void TestQuotedTags()
+{
+   // '>' in an attribute value doesn't end the tag, spaces may surround the '='
+   auto doc  = xml::ParseString(_T("<a t=\"1>2\" u = '3'><b /></a>"));
+   auto root = doc->GetRoot();
+   STDOUT << _T("t: ") << root.GetAttributeValue(_T("t")) << _T(", u: ") << root.GetAttributeValue(_T("u"))
+          << _T(", child: ") << root.GetChild(0).GetName() << std::endl;
+}
+
+void TestCharacterReferences()
+{
+   auto doc = xml::ParseString(
+       _T("<text attr=\"&lt;&#65;&#x42;&quot;\">&#233;t&#xE9; &#x1F600; &#65;&#x42;&#67 &#xD800;</text>"));
+
+   // Print code units, non-ascii symbols might not be printable
+   for (char_t c : doc->GetRoot().GetContent())
+      STDOUT << std::hex << (unsigned long)c << _T(' ');
+   STDOUT << std::dec << std::endl;
+
+   STDOUT << doc->GetRoot().GetAttributeValue(_T("attr")) << std::endl;
+}
+
+void TestDoctypeEntities()
+{
+   auto doc = xml::ParseString(_T(R"(<?xml version="1.0"?>
+<!DOCTYPE note SYSTEM "note.dtd" [
+   <!ELEMENT note (#PCDATA)>
+   <!-- <!ENTITY ignored "comment"> -->
+   <!ENTITY company "Acme &amp; Co">
+   <!ENTITY signature "Regards, &company;&#x21;">
+   <!ENTITY % param "unused">
+]>
+<note from="&company;">&signature;</note>)"));
+   STDOUT << doc->ToString() << std::endl;
+
+   try {
+      xml::ParseString(_T(R"(<!DOCTYPE lolz [
+   <!ENTITY lol "lol">
+   <!ENTITY lol1 "&lol;&lol;&lol;&lol;&lol;&lol;&lol;&lol;&lol;&lol;">
+   <!ENTITY lol2 "&lol1;&lol1;&lol1;&lol1;&lol1;&lol1;&lol1;&lol1;&lol1;&lol1;">
+   <!ENTITY lol3 "&lol2;&lol2;&lol2;&lol2;&lol2;&lol2;&lol2;&lol2;&lol2;&lol2;">
+   <!ENTITY lol4 "&lol3;&lol3;&lol3;&lol3;&lol3;&lol3;&lol3;&lol3;&lol3;&lol3;">
+   <!ENTITY lol5 "&lol4;&lol4;&lol4;&lol4;&lol4;&lol4;&lol4;&lol4;&lol4;&lol4;">
+   <!ENTITY lol6 "&lol5;&lol5;&lol5;&lol5;&lol5;&lol5;&lol5;&lol5;&lol5;&lol5;">
+   <!ENTITY lol7 "&lol6;&lol6;&lol6;&lol6;&lol6;&lol6;&lol6;&lol6;&lol6;&lol6;">
+   <!ENTITY lol8 "&lol7;&lol7;&lol7;&lol7;&lol7;&lol7;&lol7;&lol7;&lol7;&lol7;">
+   <!ENTITY lol9 "&lol8;&lol8;&lol8;&lol8;&lol8;&lol8;&lol8;&lol8;&lol8;&lol8;">
+]>
+<lolz>&lol9;</lolz>)"));
+   }
+   catch (const xml::Exception &e) {
+      STDOUT << e.what() << std::endl;
+   }
+}
+
 void TestParseFile(char *filename)
 {
-   std::basic_ifstream<char_t> file(filename);
-   auto doc = xml::ParseStream(file, true);
+   auto doc = xml::ParseFile<char_t>(filename);
    STDOUT << doc->ToString() << std::endl;
+
+   std::basic_ifstream<char_t> file(filename);
+   STDOUT << _T("Same as stream: ") << (xml::ParseStream(file)->ToString() == doc->ToString()) << std::endl;
+}
+
+void TestPushParser(const char_t *text)
+{
+   // Fragments of 7 symbols split tags, comments and entity references
+   xml::PushParser<char_t> parser;
+   std::basic_string<char_t> whole(text);
+   for (std::size_t pos = 0; pos < whole.size(); pos += 7)
+      parser.Feed(whole.data() + pos, std::min<std::size_t>(7, whole.size() - pos));
+   STDOUT << _T("Complete: ") << parser.Complete() << _T(", same as string: ")
+          << (parser.Finish()->ToString() == xml::ParseString(text)->ToString()) << std::endl;
 }
 
 
@@ -96,6 +411,40 @@ int main(int argc, char *argv[])
 
       TestParseStringAndCopy(text);
 
+      TestToStringBuffer(text);
+
+      TestParallelToString();
+
+      TestWriteToStream();
+
+      TestPrettyPrint();
+
+      TestWriter();
+
+      TestCanonical();
+
+      TestElementToString(text);
+
+      TestSnapshot(text);
+
+      TestBinary(text);
+
+      TestUtf8(text);
+
+      TestKeepSource();
+
+      TestSharedStrings(text);
+
+      TestGenericSpaces();
+
+      TestQuotedTags();
+
+      TestCharacterReferences();
+
+      TestDoctypeEntities();
+
+      TestPushParser(text);
+
       TestNewDocument();
    }
    catch (const xml::Exception &e) {
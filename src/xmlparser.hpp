@@ -22,16 +22,144 @@
 #include <stack>
 #include <stdexcept>
 #include <unordered_map>
+#include <map>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <memory>
 #include <istream>
-#include <sstream>
+#include <fstream>
+#include <ostream>
 #include <cctype>
 #include <cwctype>
+#include <cstring>
 #include <list>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+#include <system_error>
+#include <array>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define XMLPARSER_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define XMLPARSER_POSIX
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 
 namespace xml {
+
+class Exception : std::logic_error
+{
+public:
+   Exception(const char *what) : std::logic_error(what)
+   {}
+   Exception(const std::string &what) : std::logic_error(what)
+   {}
+   virtual const char *what() const noexcept
+   {
+      return std::logic_error::what();
+   }
+};
+
+// Settings for parsing text into an xml::Document
+struct ParseOptions
+{
+   // Replace entity references in content by the corresponding symbols
+   bool entity_references = true;
+   // Store element names, attribute names and short attribute values in the process-wide StringTable
+   bool intern_strings = false;
+   // Attribute values longer than this are not interned
+   std::size_t intern_max_length = 32;
+   // How deep references to entities declared in the DTD may nest inside values of other such entities
+   std::size_t max_entity_depth = 16;
+   // Total number of symbols that expanding entities declared in the DTD may produce in one document
+   std::size_t max_entity_expansion = 1 << 20;
+   // Keep a copy of the text, so that elements that haven't been modified are serialized by copying their
+   // source, including comments and formatting. Ignored if the DTD declares entities.
+   bool keep_source = false;
+};
+
+struct WriteOptions
+{
+   // Put every element on its own line and indent it according to its depth. Content is written as is.
+   bool pretty = false;
+   // Number of spaces per level of indentation
+   std::size_t indent_width = 3;
+   // Use "\r\n" instead of "\n"
+   bool crlf = false;
+   // Put every attribute on its own line, indented one level deeper than its element
+   bool wrap_attributes = false;
+   // Number of threads used by Document::ToString() for documents of at least 'parallel_min_size' symbols,
+   // 0 means one per hardware thread. Pretty-printing is always done in one thread.
+   std::size_t threads = 1;
+   std::size_t parallel_min_size = 1 << 20;
+};
+
+// Process-wide, thread-safe and append-only table of strings. Equal strings interned by different documents
+// share one copy, which stays valid (and at the same address) until the process ends.
+template <typename TChar>
+class StringTable
+{
+public:
+   typedef std::basic_string<TChar> string_t;
+   typedef std::basic_string_view<TChar> view_t;
+
+   static StringTable &Global()
+   {
+      static StringTable table;
+      return table;
+   }
+
+   StringTable(const StringTable &) = delete;
+   StringTable &operator=(const StringTable &) = delete;
+
+   // Returns the stored copy of 'str', adding it first if it isn't in the table yet.
+   const string_t *Intern(view_t str)
+   {
+      {
+         std::shared_lock<std::shared_mutex> lock(mutex_);
+         auto it = index_.find(str);
+         if (it != index_.cend())
+            return it->second;
+      }
+      std::unique_lock<std::shared_mutex> lock(mutex_);
+      auto it = index_.find(str);
+      if (it != index_.cend())
+         return it->second;
+
+      const string_t *pstr = &storage_.emplace_back(str); // deque never relocates its elements
+      index_.emplace(*pstr, pstr);
+      return pstr;
+   }
+   std::size_t Size() const
+   {
+      std::shared_lock<std::shared_mutex> lock(mutex_);
+      return storage_.size();
+   }
+
+private:
+   StringTable() = default;
+
+   mutable std::shared_mutex mutex_;
+   std::deque<string_t> storage_;
+   std::unordered_map<view_t, const string_t *> index_;
+};
+
 namespace details {
 
 // Some helpers for resolving the correct standard library functions
@@ -40,7 +168,7 @@ template <typename TChar>
 bool IsSpace(TChar symbol)
 {
    unsigned val = static_cast<unsigned>(symbol);
-   return val >= 9 && val <= 13;
+   return val == 32 || (val >= 9 && val <= 13);
 }
 
 #define IS_SPACE(func, type)              \
@@ -75,20 +203,220 @@ IS_ALPHA(std::iswalpha, wchar_t)
 
 #undef IS_ALPHA
 
-// Tables for different encodings, mapping entity references to ascii symbols
+// Index of the lowest set bit in 'mask', which must be non-zero
+inline unsigned LowestBit(unsigned mask) noexcept
+{
+#ifdef _MSC_VER
+   unsigned long index;
+   _BitScanForward(&index, mask);
+   return static_cast<unsigned>(index);
+#else
+   return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+// Number of set bits in 'mask'
+inline unsigned BitCount(unsigned mask) noexcept
+{
+#ifdef _MSC_VER
+   return __popcnt(mask);
+#else
+   return static_cast<unsigned>(__builtin_popcount(mask));
+#endif
+}
+
+#ifdef XMLPARSER_SSE2
+
+// Whether TChar fits the 8-, 16- or 32-bit lanes of an SSE2 register
+template <typename TChar>
+constexpr bool HAS_SIMD_LANES = sizeof(TChar) == 1 || sizeof(TChar) == 2 || sizeof(TChar) == 4;
+
+// Number of TChar symbols processed per SSE2 register
+template <typename TChar>
+constexpr std::ptrdiff_t SIMD_LANES = 16 / sizeof(TChar);
+
+template <typename TChar>
+inline __m128i LoadLanes(const TChar *pit) noexcept
+{
+   return _mm_loadu_si128(reinterpret_cast<const __m128i *>(pit));
+}
+template <typename TChar>
+inline __m128i SplatLanes(TChar symbol) noexcept
+{
+   if constexpr (sizeof(TChar) == 1)
+      return _mm_set1_epi8(static_cast<char>(symbol));
+   else if constexpr (sizeof(TChar) == 2)
+      return _mm_set1_epi16(static_cast<short>(symbol));
+   else
+      return _mm_set1_epi32(static_cast<int>(symbol));
+}
+template <typename TChar>
+inline __m128i EqualLanes(__m128i lhs, __m128i rhs) noexcept
+{
+   if constexpr (sizeof(TChar) == 1)
+      return _mm_cmpeq_epi8(lhs, rhs);
+   else if constexpr (sizeof(TChar) == 2)
+      return _mm_cmpeq_epi16(lhs, rhs);
+   else
+      return _mm_cmpeq_epi32(lhs, rhs);
+}
+// One bit per byte, so each matching lane sets sizeof(TChar) bits
+inline unsigned LaneMask(__m128i lanes) noexcept
+{
+   return static_cast<unsigned>(_mm_movemask_epi8(lanes));
+}
+
+#endif // XMLPARSER_SSE2
+
+// Returns pointer to the first 'symbol' in [pbegin, pend), or pend if there is none. Uses memchr for narrow
+// chars and compares 16 bytes at a time for wide chars when SSE2 is available.
+template <typename TChar>
+const TChar *FindSymbol(const TChar *pbegin, const TChar *pend, TChar symbol) noexcept
+{
+   if constexpr (sizeof(TChar) == 1) {
+      const void *pfound = std::memchr(pbegin, static_cast<unsigned char>(symbol), pend - pbegin);
+      return pfound ? static_cast<const TChar *>(pfound) : pend;
+   }
+#ifdef XMLPARSER_SSE2
+   else if constexpr (HAS_SIMD_LANES<TChar>) {
+      const __m128i needle = SplatLanes(symbol);
+      for (; pend - pbegin >= SIMD_LANES<TChar>; pbegin += SIMD_LANES<TChar>) {
+         unsigned mask = LaneMask(EqualLanes<TChar>(LoadLanes(pbegin), needle));
+         if (mask) {
+            return pbegin + LowestBit(mask) / sizeof(TChar);
+         }
+      }
+   }
+#endif
+   return std::find(pbegin, pend, symbol);
+}
+
+// Converts 'str' to a narrow string for use in exception messages. Non-ascii symbols are replaced by '?'.
+template <typename TChar>
+std::string Narrow(std::basic_string_view<TChar> str)
+{
+   std::string result(str.size(), '?');
+   for (std::size_t i = 0; i < str.size(); ++i) {
+      auto val = static_cast<std::make_unsigned_t<TChar>>(str[i]);
+      if (val < 128)
+         result[i] = static_cast<char>(val);
+   }
+   return result;
+}
+
+// String that either owns its data or refers to an entry in StringTable. Two interned strings are compared by
+// address only.
+template <typename TChar>
+class SharedString
+{
+public:
+   typedef std::basic_string<TChar> string_t;
+   typedef std::basic_string_view<TChar> view_t;
+
+   SharedString() = default;
+   explicit SharedString(string_t str) : own_(std::move(str))
+   {}
+   explicit SharedString(const string_t *pshared) noexcept : pshared_(pshared)
+   {}
+   SharedString &operator=(string_t str)
+   {
+      own_     = std::move(str);
+      pshared_ = nullptr;
+      return *this;
+   }
+
+   const string_t &Get() const noexcept
+   {
+      return pshared_ ? *pshared_ : own_;
+   }
+   operator view_t() const noexcept
+   {
+      return Get();
+   }
+   bool IsShared() const noexcept
+   {
+      return pshared_ != nullptr;
+   }
+
+   friend bool operator==(const SharedString &lhs, const SharedString &rhs) noexcept
+   {
+      if (lhs.pshared_ && rhs.pshared_)
+         return lhs.pshared_ == rhs.pshared_;
+      return lhs.Get() == rhs.Get();
+   }
+   friend bool operator!=(const SharedString &lhs, const SharedString &rhs) noexcept
+   {
+      return !(lhs == rhs);
+   }
+   friend bool operator<(const SharedString &lhs, const SharedString &rhs) noexcept
+   {
+      return lhs.Get() < rhs.Get();
+   }
+
+private:
+   const string_t *pshared_ = nullptr;
+   string_t own_;
+};
+
+// Attribute storage. Transparent comparator allows lookup by std::basic_string_view without allocating a key.
+template <typename TChar>
+using AttrMap = std::map<SharedString<TChar>, SharedString<TChar>, std::less<>>;
+
+// Creates strings for one document being parsed, interning them if requested. Remembers strings it has already
+// interned, so that repeated names don't lock the global table again.
+template <typename TChar>
+class Interner
+{
+public:
+   typedef std::basic_string_view<TChar> view_t;
+
+   explicit Interner(const ParseOptions &options)
+       : enabled_(options.intern_strings), max_value_length_(options.intern_max_length)
+   {}
+   SharedString<TChar> MakeName(view_t str)
+   {
+      if (!enabled_)
+         return SharedString<TChar>(std::basic_string<TChar>(str));
+      return SharedString<TChar>(Intern(str));
+   }
+   SharedString<TChar> MakeValue(view_t str)
+   {
+      if (!enabled_ || str.size() > max_value_length_)
+         return SharedString<TChar>(std::basic_string<TChar>(str));
+      return SharedString<TChar>(Intern(str));
+   }
+
+private:
+   const std::basic_string<TChar> *Intern(view_t str)
+   {
+      auto it = cache_.find(str);
+      if (it != cache_.cend())
+         return it->second;
+      const std::basic_string<TChar> *pshared = StringTable<TChar>::Global().Intern(str);
+      cache_.emplace(*pshared, pshared);
+      return pshared;
+   }
+
+   bool enabled_;
+   std::size_t max_value_length_;
+   std::unordered_map<view_t, const std::basic_string<TChar> *> cache_;
+};
+
+// Tables for different encodings, mapping predefined entity references to ascii symbols. Numeric character
+// references are decoded separately, see ParseCharRef().
 template <typename TChar>
 const TChar **EntityRefTable(std::size_t index) noexcept;
 
-#define ENTITY_REF_TABLE(prefix, type)                                                                       \
-   template <>                                                                                               \
-   inline const type **EntityRefTable<type>(std::size_t index) noexcept                                      \
-   {                                                                                                         \
-      static const type *table[][4] = {{prefix##"&amp;", prefix##"&#38;", prefix##"&#x26;", prefix##"&"},    \
-                                       {prefix##"&lt;", prefix##"&#60;", prefix##"&#x3C;", prefix##"<"},     \
-                                       {prefix##"&gt;", prefix##"&#62;", prefix##"&#x3E;", prefix##">"},     \
-                                       {prefix##"&quot;", prefix##"&#34;", prefix##"&#x22;", prefix##"\""},  \
-                                       {prefix##"&apos;", prefix##"&#39;", prefix##"&#x27;", prefix##"\'"}}; \
-      return table[index];                                                                                   \
+#define ENTITY_REF_TABLE(prefix, type)                                    \
+   template <>                                                            \
+   inline const type **EntityRefTable<type>(std::size_t index) noexcept   \
+   {                                                                      \
+      static const type *table[][2] = {{prefix##"&amp;", prefix##"&"},    \
+                                       {prefix##"&lt;", prefix##"<"},     \
+                                       {prefix##"&gt;", prefix##">"},     \
+                                       {prefix##"&quot;", prefix##"\""},  \
+                                       {prefix##"&apos;", prefix##"\'"}}; \
+      return table[index];                                                \
    }
 
 ENTITY_REF_TABLE(, char)
@@ -118,17 +446,19 @@ DECLARATION_ATTRS(U, char32_t)
 
 #undef DECLARATION_ATTRS
 
-// XML markup for writing
+// XML markup for writing. Views carry the length, so that fragments can be copied without searching for the
+// null-terminator.
 template <typename TChar>
-const TChar *MarkupTable(std::size_t index) noexcept;
+std::basic_string_view<TChar> MarkupTable(std::size_t index) noexcept;
 
-#define MARKUP_TABLE(prefix, type)                                                                           \
-   template <>                                                                                               \
-   inline const type *MarkupTable<type>(std::size_t index) noexcept                                          \
-   {                                                                                                         \
-      static const type *table[] = {prefix##"<", prefix##">",  prefix##" />",   prefix##"</", prefix##"=\"", \
-                                    prefix##" ", prefix##"\"", prefix##"<?xml", prefix##" ?>"};              \
-      return table[index];                                                                                   \
+#define MARKUP_TABLE(prefix, type)                                                                                  \
+   template <>                                                                                                      \
+   inline std::basic_string_view<type> MarkupTable<type>(std::size_t index) noexcept                                \
+   {                                                                                                                \
+      static const std::basic_string_view<type> table[] = {prefix##"<",  prefix##">",     prefix##" />",           \
+                                                           prefix##"</", prefix##"=\"",   prefix##" ",             \
+                                                           prefix##"\"", prefix##"<?xml", prefix##" ?>"};           \
+      return table[index];                                                                                          \
    }
 
 MARKUP_TABLE(, char)
@@ -154,19 +484,71 @@ enum Markup : size_t
 
 
 
+// Whether 'pit' points to a start or end tag, rather than to a comment, CDATA, DTD or processing instruction
+template <typename TChar>
+inline bool IsTagStart(const TChar *pit) noexcept
+{
+   return pit[0] == (TChar)'<' && pit[1] != (TChar)'!' && pit[1] != (TChar)'?';
+}
+
+// Searches from 'pbegin' for the '>' ending the tag whose '<' is in front of it. Quoted attribute values are skipped,
+// since they may contain '>'. Returns pointer to the '>', to a '<' if the tag ends without one, or to 'pend' or the
+// null-terminator, whichever comes first, if the tag doesn't end before. '*pquote' is the quote of the value being
+// skipped, if any, so that a search can continue with more text.
+template <typename TChar>
+const TChar *FindTagEnd(const TChar *pbegin, const TChar *pend, TChar *pquote) noexcept
+{
+   for (const TChar *pit = pbegin;; ++pit) {
+      if (*pquote) {
+         while (pit != pend && *pit && *pit != *pquote)
+            ++pit;
+         if (pit == pend || !*pit)
+            return pit;
+         *pquote = 0;
+         continue;
+      }
+      while (pit != pend && *pit && *pit != (TChar)'>' && *pit != (TChar)'<' && *pit != (TChar)'"' &&
+             *pit != (TChar)'\'')
+         ++pit;
+      if (pit == pend || !*pit || *pit == (TChar)'>' || *pit == (TChar)'<')
+         return pit;
+      // Only a quote behind a '=' starts a value, the '<' of the tag stops the search
+      const TChar *pprev = pit - 1;
+      while (IsSpace(*pprev))
+         --pprev;
+      if (*pprev == (TChar)'=')
+         *pquote = *pit;
+   }
+}
+template <typename TChar>
+const TChar *FindTagEnd(const TChar *pbegin, const TChar *pend) noexcept
+{
+   TChar quote = 0;
+   return FindTagEnd(pbegin, pend, &quote);
+}
+
 // Creates a list of pointers: each one pointing either to a '<' or behind a '>'.
-// Text between each pair of successive pointers is a token.
+// Text between each pair of successive pointers is a token. Symbols in quoted attribute values don't end tags.
 template <typename TChar>
 std::list<const TChar *> Tokenize(const TChar *text)
 {
    std::list<const TChar *> tokens;
    tokens.emplace_back(text);
    const TChar *pit;
-   for (pit = text + 1; *pit; ++pit) {
-      if (*pit == '<')
-         tokens.emplace_back(pit);
-      else if (*(pit - 1) == '>')
+   for (pit = text; *pit; ++pit) {
+      if (*pit == '<') {
+         if (pit != text)
+            tokens.emplace_back(pit);
+         if (IsTagStart(pit)) {
+            // Continues behind the '>', or at a '<' ending the tag so that it starts the next token
+            pit = FindTagEnd<TChar>(pit + 1, nullptr);
+            if (*pit != '>')
+               --pit;
+         }
+      }
+      else if (pit != text && *(pit - 1) == '>') {
          tokens.emplace_back(pit);
+      }
    }
    if (*tokens.back()) {
       // add null-terminator
@@ -264,8 +646,8 @@ int DetermineToken(const TChar *pbegin, const TChar *pend) noexcept
          return Token::COMMENT;
       }
 
-      pbegin = std::find(pbegin, pend, (TChar)'>');
-      if (pbegin == pend) {
+      pbegin = FindTagEnd(pbegin + 1, pend);
+      if (pbegin == pend || *pbegin != (TChar)'>') {
          return Token::ERROR;
       }
       int what = Token::OPEN;
@@ -276,242 +658,2728 @@ int DetermineToken(const TChar *pbegin, const TChar *pend) noexcept
    return Token::CONTENT;
 }
 
-// Removes comment tokens in the beginning of the list
+// Checks whether 'from' points to start of a predefined entity reference that ends before 'end'. If so,
+// returns a pointer to the substitution string and writes the length of the entity reference to 'count'.
+// Returns nullptr if no entity reference at 'from'.
 template <typename TChar>
-inline void RemoveLeadingComments(std::list<const TChar *> *tokens)
+const TChar *CheckEntityRef(const TChar *from, const TChar *end, std::size_t *count, std::size_t er_index)
 {
-   auto it_right = tokens->begin();
-   auto it_left  = it_right++;
+   const TChar **table_line = EntityRefTable<TChar>(er_index);
+   const TChar *word        = table_line[0];
+   const TChar *pit         = from;
 
-   while (DetermineToken(*it_left, *it_right) == Token::COMMENT) {
-      ++it_right;
-      ++it_left;
-      tokens->pop_front();
+   while (*word && pit != end && *word == *pit) {
+      ++word;
+      ++pit;
    }
+   if (!*word) {
+      *count = pit - from;
+      return table_line[1];
+   }
+   return nullptr;
 }
 
-// Reads element name from the opening tag starting at pbegin (it must point to a '<').
+// Value of a hexadecimal digit, or -1 if 'symbol' is not one.
 template <typename TChar>
-std::basic_string<TChar> ExtractName(const TChar *pbegin, const TChar *pend)
+inline int HexValue(TChar symbol) noexcept
 {
-   pend = std::find_if(++pbegin, pend, [](TChar c) { return IsSpace(c) || c == (TChar)'>' || c == (TChar)'/'; });
-   return std::basic_string<TChar>(pbegin, pend);
+   if (symbol >= (TChar)'0' && symbol <= (TChar)'9')
+      return symbol - (TChar)'0';
+   if (symbol >= (TChar)'a' && symbol <= (TChar)'f')
+      return symbol - (TChar)'a' + 10;
+   if (symbol >= (TChar)'A' && symbol <= (TChar)'F')
+      return symbol - (TChar)'A' + 10;
+   return -1;
 }
 
-// Reads attribute pairs from the tag starting at pbegin (it must point to a '<').
+// Parses a numeric character reference (&#N; or &#xH;) starting at 'from', which must point to "&#". Returns
+// the referenced code point and writes the length of the reference to 'count'. Returns 0 if the reference is
+// malformed, unterminated before 'end', or doesn't denote a valid unicode scalar value.
 template <typename TChar>
-std::unordered_map<std::basic_string<TChar>, std::basic_string<TChar>> ExtractAttributes(const TChar *pbegin,
-                                                                                         const TChar *pend)
+char32_t ParseCharRef(const TChar *from, const TChar *end, std::size_t *count) noexcept
 {
-   std::unordered_map<std::basic_string<TChar>, std::basic_string<TChar>> attrs;
-   // skip element name
-   pbegin = std::find_if(pbegin, pend, [](TChar c) { return c == (TChar)'>' || IsSpace(c); });
+   const TChar *pit = from + 2;
+   char32_t code    = 0;
 
-   while (pbegin < pend) {
-      const TChar *keybegin = std::find_if(pbegin, pend, IsAlpha<TChar>);
-      if (keybegin == pend) {
-         return attrs;
+   if (pit != end && *pit == (TChar)'x') {
+      const TChar *digits = ++pit;
+      for (int digit; pit != end && (digit = HexValue(*pit)) >= 0; ++pit) {
+         code = (code << 4) | static_cast<char32_t>(digit);
+         if (code > 0x10FFFF)
+            return 0;
       }
-      const TChar *keyend   = std::find(keybegin, pend, (TChar)'=');
-      const TChar *valbegin = keyend + 2;
-      const TChar *valend   = std::find(valbegin, pend, *(valbegin - 1)); // either " or '
-
-      std::basic_string<TChar> key(keybegin, keyend);
-      std::basic_string<TChar> value(valbegin, valend);
-      attrs.emplace(std::move(key), std::move(value));
-      pbegin = valend;
+      if (pit == digits)
+         return 0;
    }
-   return attrs;
+   else {
+      const TChar *digits = pit;
+      for (; pit != end && *pit >= (TChar)'0' && *pit <= (TChar)'9'; ++pit) {
+         code = code * 10 + static_cast<char32_t>(*pit - (TChar)'0');
+         if (code > 0x10FFFF)
+            return 0;
+      }
+      if (pit == digits)
+         return 0;
+   }
+   if (pit == end || *pit != (TChar)';' || (code >= 0xD800 && code <= 0xDFFF))
+      return 0;
+
+   *count = pit + 1 - from;
+   return code;
 }
 
-// Checks whether 'from' points to start of an entity reference. If so, returns a pointer to the
-// substitution string and writes the length of the entity reference to 'count'. Returns nullptr if no
-// entity reference at 'from'.
+// Appends code point 'code' to 'out' as UTF-8 for narrow chars, UTF-16 for 16-bit chars and UTF-32 otherwise.
 template <typename TChar>
-const TChar *CheckEntityRef(const TChar *from, std::size_t *count, std::size_t er_index)
+void AppendCodePoint(std::basic_string<TChar> *out, char32_t code)
 {
-   const TChar **table_line = EntityRefTable<TChar>(er_index);
-   for (int col = 0; col < 3; ++col) {
-      // Compare with all 3 representations
-      const TChar *word = table_line[col];
-      const TChar *pit  = from;
-
-      bool equal = true;
-      while (*word && *pit) {
-         if (*word++ != *pit++) {
-            equal = false;
-            break;
-         }
+   if constexpr (sizeof(TChar) == 1) {
+      if (code < 0x80) {
+         out->push_back(static_cast<TChar>(code));
       }
-      if (equal) {
-         *count = pit - from;
-         return table_line[3];
+      else if (code < 0x800) {
+         TChar units[] = {static_cast<TChar>(0xC0 | (code >> 6)), static_cast<TChar>(0x80 | (code & 0x3F))};
+         out->append(units, 2);
+      }
+      else if (code < 0x10000) {
+         TChar units[] = {static_cast<TChar>(0xE0 | (code >> 12)), static_cast<TChar>(0x80 | ((code >> 6) & 0x3F)),
+                          static_cast<TChar>(0x80 | (code & 0x3F))};
+         out->append(units, 3);
+      }
+      else {
+         TChar units[] = {static_cast<TChar>(0xF0 | (code >> 18)), static_cast<TChar>(0x80 | ((code >> 12) & 0x3F)),
+                          static_cast<TChar>(0x80 | ((code >> 6) & 0x3F)), static_cast<TChar>(0x80 | (code & 0x3F))};
+         out->append(units, 4);
       }
    }
-   return nullptr;
+   else if constexpr (sizeof(TChar) == 2) {
+      if (code < 0x10000) {
+         out->push_back(static_cast<TChar>(code));
+      }
+      else {
+         code -= 0x10000;
+         TChar units[] = {static_cast<TChar>(0xD800 | (code >> 10)), static_cast<TChar>(0xDC00 | (code & 0x3FF))};
+         out->append(units, 2);
+      }
+   }
+   else {
+      out->push_back(static_cast<TChar>(code));
+   }
 }
 
-// Replaces all entity references in 'content' by the corresponding ascii symbols.
+// Appends [pbegin, pend) to 'out', replacing numeric character references only.
 template <typename TChar>
-void SubstituteEntityRef(std::basic_string<TChar> *content)
+void SubstituteCharRef(std::basic_string<TChar> *out, const TChar *pbegin, const TChar *pend)
 {
-   if (content->empty()) {
-      return;
-   }
-   size_t count = 0;
-   for (const TChar *from = &content->front(); from < &content->back() - 2; ++from) {
-      // Compare 'from' with all 5 entity references
-      for (int er_index = 0; er_index < 5; ++er_index) {
-         const TChar *repl_str = CheckEntityRef(from, &count, er_index);
-         if (repl_str) {
-            std::size_t pos = from - &content->front();
-            content->replace(pos, count, repl_str); // no better overload :(
-            from = &content->front() + pos;
-            break;
-         }
+   for (const TChar *pit = FindSymbol(pbegin, pend, (TChar)'&'); pit != pend; pit = FindSymbol(pit, pend, (TChar)'&')) {
+      std::size_t count = 0;
+      char32_t code     = pit + 1 != pend && pit[1] == (TChar)'#' ? ParseCharRef(pit, pend, &count) : 0;
+      if (code) {
+         out->append(pbegin, pit);
+         AppendCodePoint(out, code);
+         pit += count;
+         pbegin = pit;
+      }
+      else {
+         ++pit;
       }
    }
+   out->append(pbegin, pend);
 }
 
-// Replaces unallowed symbols in 'content' by entity references (uses first column)
+// General entities declared in the internal DTD subset of one document. Values are stored with character
+// references already replaced, but references to other entities are kept for expanding at the point of use.
 template <typename TChar>
-std::basic_string<TChar> InsertEntityRef(std::basic_string<TChar> content)
+class EntityTable
 {
-   for (auto it = content.begin(); it != content.end(); ++it) {
-      for (int er_index = 0; er_index < 5; ++er_index) {
-         const TChar **table_line = EntityRefTable<TChar>(er_index);
+public:
+   typedef std::basic_string<TChar> string_t;
+   typedef std::basic_string_view<TChar> view_t;
 
-         if (*it == *table_line[3]) { // comparing only one char
-            std::size_t pos = it - content.begin();
-            content.replace(pos, 1, table_line[0]); // uses first column for substitution
-            it = content.begin() + pos + 3;         // min length of ER is 4 = 3+1
-            break;
-         }
-      }
+   // The first declaration of an entity is binding, later ones are ignored
+   void Add(view_t name, string_t value)
+   {
+      if (entities_.find(name) != entities_.cend())
+         return;
+      names_.emplace_back(name);
+      entities_.emplace(names_.back(), std::move(value));
+   }
+   // Replacement text of entity 'name', or nullptr if it hasn't been declared
+   const string_t *Find(view_t name) const
+   {
+      auto it = entities_.find(name);
+      return it != entities_.cend() ? &it->second : nullptr;
+   }
+   bool Empty() const noexcept
+   {
+      return entities_.empty();
    }
-   return std::move(content);
-}
 
-// Node in the resulting tree. Contains all data about one xml element and pointers to its children.
+private:
+   std::deque<string_t> names_; // never relocates elements, so that keys can refer to them
+   std::unordered_map<view_t, string_t> entities_;
+};
+
+// Replaces entity references by the corresponding symbols: the 5 predefined entities, numeric character
+// references, and entities from an EntityTable. Values of table entities are expanded recursively, within the
+// depth and size limits from ParseOptions.
 template <typename TChar>
-struct ElementData
+class EntityDecoder
 {
-   typedef TChar char_t;
-   typedef std::basic_string<char_t> string_t;
-   typedef ElementData<char_t> my_t;
+public:
+   typedef std::basic_string<TChar> string_t;
 
-   ElementData() = default;
-   ElementData(const string_t &name, const string_t &content, const std::unordered_map<string_t, string_t> &attrs)
-       : name(name), content(content), attrs(attrs)
+   EntityDecoder(const EntityTable<TChar> &entities, const ParseOptions &options)
+       : entities_(entities), max_depth_(options.max_entity_depth), max_expansion_(options.max_entity_expansion)
    {}
-   std::unique_ptr<my_t> Copy() const
+
+   // Appends [pbegin, pend) to 'out', replacing all entity references. Makes a single pass over the input and
+   // copies text between entity references in bulk.
+   void Append(string_t *out, const TChar *pbegin, const TChar *pend)
+   {
+      Append(out, pbegin, pend, 0);
+   }
+
+private:
+   void Append(string_t *out, const TChar *pbegin, const TChar *pend, std::size_t depth)
    {
-      auto pcopy = std::make_unique<my_t>(name, content, attrs);
-      for (const auto &pchild : children) {
-         auto pchild_copy = pchild->Copy();
-         pcopy->children.emplace_back(std::move(pchild_copy));
+      std::size_t accounted  = out->size();
+      const TChar *copy_from = pbegin;
+      const TChar *pit       = FindSymbol(pbegin, pend, (TChar)'&');
+
+      while (pit != pend) {
+         std::size_t count = 0;
+         if (pit + 1 != pend && pit[1] == (TChar)'#') {
+            char32_t code = ParseCharRef(pit, pend, &count);
+            if (code) {
+               out->append(copy_from, pit);
+               AppendCodePoint(out, code);
+            }
+         }
+         else {
+            const TChar *repl_str = nullptr;
+            // Compare 'pit' with all 5 predefined entity references
+            for (int er_index = 0; er_index < 5 && !repl_str; ++er_index) {
+               repl_str = CheckEntityRef(pit, pend, &count, er_index);
+            }
+            if (repl_str) {
+               out->append(copy_from, pit);
+               out->push_back(*repl_str); // all substitutions are one symbol long
+            }
+            else if (const string_t *value = FindDeclared(pit, pend, &count)) {
+               out->append(copy_from, pit);
+               Account(out->size() - accounted, depth);
+               if (depth >= max_depth_) {
+                  throw Exception("Entity references are nested too deep");
+               }
+               Append(out, value->data(), value->data() + value->size(), depth + 1);
+               accounted = out->size();
+            }
+         }
+         if (count) {
+            pit += count;
+            copy_from = pit;
+         }
+         else {
+            ++pit;
+         }
+         pit = FindSymbol(pit, pend, (TChar)'&');
       }
-      return std::move(pcopy);
+      out->append(copy_from, pend);
+      Account(out->size() - accounted, depth);
    }
 
-   string_t name;
-   string_t content;
-   std::unordered_map<string_t, string_t> attrs;
-   std::vector<std::unique_ptr<my_t>> children;
+   // Checks whether 'from' points to a reference to an entity from the table, see CheckEntityRef()
+   const string_t *FindDeclared(const TChar *from, const TChar *end, std::size_t *count) const
+   {
+      if (entities_.Empty())
+         return nullptr;
+      const TChar *name_end = std::find(from + 1, end, (TChar)';');
+      if (name_end == end)
+         return nullptr;
+      const string_t *value = entities_.Find(std::basic_string_view<TChar>(from + 1, name_end - from - 1));
+      if (value)
+         *count = name_end + 1 - from;
+      return value;
+   }
+
+   // Counts symbols produced by expanding entity values, i.e. written at depth > 0
+   void Account(std::size_t produced, std::size_t depth)
+   {
+      if (depth == 0)
+         return;
+      expanded_ += produced;
+      if (expanded_ > max_expansion_) {
+         throw Exception("Entity expansion limit exceeded");
+      }
+   }
+
+   const EntityTable<TChar> &entities_;
+   std::size_t max_depth_;
+   std::size_t max_expansion_;
+   std::size_t expanded_ = 0;
 };
 
+// Checks whether 'pit' starts with ascii 'word'. Stops at the null-terminator.
 template <typename TChar>
-std::basic_ostream<TChar> &operator<<(std::basic_ostream<TChar> &out, const ElementData<TChar> &e)
+inline bool StartsWith(const TChar *pit, const char *word) noexcept
 {
-   out << MarkupTable<TChar>(Markup::OPENING_TAG_START) << e.name;
-   for (const auto &attr : e.attrs) {
-      out << MarkupTable<TChar>(Markup::ATTR_START) << attr.first << MarkupTable<TChar>(Markup::ATTR_MID) << attr.second
-          << MarkupTable<TChar>(Markup::ATTR_END);
-   }
-   if (e.content.empty() && e.children.empty()) {
-      return out << MarkupTable<TChar>(Markup::SINGLE_TAG_END);
+   for (; *word; ++word, ++pit) {
+      if (*pit != (TChar)*word)
+         return false;
    }
-   out << MarkupTable<TChar>(Markup::OPENING_TAG_END);
-   out << InsertEntityRef(e.content);
-   for (const auto &pchild : e.children) {
-      out << *pchild;
-   }
-   out << MarkupTable<TChar>(Markup::CLOSING_TAG_START) << e.name << MarkupTable<TChar>(Markup::CLOSING_TAG_END);
-   return out;
+   return true;
 }
 
-// Builds the element tree and returns pointer to its root. Declaration token must be removed from
-// 'tokens' prior to calling this function. Ignores the rest after the root element has been closed.
+// Returns pointer to the first non-whitespace symbol at or after 'pit'
 template <typename TChar>
-std::unique_ptr<ElementData<TChar>> BuildElementTree(const std::list<const TChar *> &tokens, bool replace_er)
+inline const TChar *SkipSpaces(const TChar *pit) noexcept
 {
-   // Create stack and iterators
-   std::stack<ElementData<TChar> *, std::list<ElementData<TChar> *>> tree;
+   while (*pit && IsSpace(*pit))
+      ++pit;
+   return pit;
+}
 
-   auto it_right = tokens.begin();
-   auto it_left  = it_right++;
+// Returns pointer behind the first occurrence of ascii 'word' at or after 'pit', or nullptr if the text ends
+// before that.
+template <typename TChar>
+const TChar *SkipPast(const TChar *pit, const char *word) noexcept
+{
+   for (; *pit; ++pit) {
+      if (StartsWith(pit, word))
+         return pit + std::strlen(word);
+   }
+   return nullptr;
+}
 
-   // Set up root and push on stack
-   auto root   = std::make_unique<ElementData<TChar>>();
-   root->name  = ExtractName(*it_left, *it_right);
-   root->attrs = ExtractAttributes(*it_left, *it_right);
-   tree.push(root.get());
+// Returns pointer behind the '>' that closes the markup declaration containing 'pit', skipping over quoted
+// literals. Returns nullptr if the text ends before that.
+template <typename TChar>
+const TChar *SkipMarkupDecl(const TChar *pit) noexcept
+{
+   for (; *pit; ++pit) {
+      if (*pit == (TChar)'"' || *pit == (TChar)'\'') {
+         TChar quote = *pit;
+         while (*++pit != quote) {
+            if (!*pit)
+               return nullptr;
+         }
+      }
+      else if (*pit == (TChar)'>') {
+         return pit + 1;
+      }
+   }
+   return nullptr;
+}
 
-   ++it_right;
-   ++it_left;
+// Parses an entity declaration, 'pit' must point behind "<!ENTITY". Adds general entities with literal
+// values to 'entities'; parameter entities and external entities are skipped. Returns pointer behind the
+// declaration, or nullptr if it's malformed.
+template <typename TChar>
+const TChar *ParseEntityDecl(const TChar *pit, EntityTable<TChar> *entities)
+{
+   const TChar *name_begin = SkipSpaces(pit);
+   if (*name_begin == (TChar)'%') {
+      return SkipMarkupDecl(name_begin);
+   }
+   const TChar *name_end = name_begin;
+   while (*name_end && !IsSpace(*name_end) && *name_end != (TChar)'"' && *name_end != (TChar)'\'' &&
+          *name_end != (TChar)'>')
+      ++name_end;
+   if (name_end == name_begin) {
+      return nullptr;
+   }
+   pit = SkipSpaces(name_end);
+   if (*pit == (TChar)'"' || *pit == (TChar)'\'') {
+      const TChar *value_begin = pit + 1;
+      const TChar *value_end   = value_begin;
+      while (*value_end != *pit) {
+         if (!*value_end++)
+            return nullptr;
+      }
+      std::basic_string<TChar> value;
+      SubstituteCharRef(&value, value_begin, value_end);
+      entities->Add(std::basic_string_view<TChar>(name_begin, name_end - name_begin), std::move(value));
+      pit = value_end + 1;
+   }
+   return SkipMarkupDecl(pit);
+}
+
+// Parses a document type declaration, 'pit' must point behind "<!DOCTYPE". Collects entities declared in the
+// internal subset and skips all other declarations. Returns pointer behind the closing '>', or nullptr if the
+// declaration is malformed.
+template <typename TChar>
+const TChar *ParseDoctype(const TChar *pit, EntityTable<TChar> *entities)
+{
+   // Root element name and external id
+   for (pit = SkipSpaces(pit); *pit != (TChar)'['; pit = SkipSpaces(pit)) {
+      if (*pit == (TChar)'>')
+         return pit + 1;
+      if (*pit == (TChar)'"' || *pit == (TChar)'\'') {
+         TChar quote = *pit;
+         while (*++pit != quote) {
+            if (!*pit)
+               return nullptr;
+         }
+      }
+      if (!*pit++)
+         return nullptr;
+   }
+   // Internal subset
+   for (pit = SkipSpaces(pit + 1); *pit != (TChar)']'; pit = SkipSpaces(pit)) {
+      if (StartsWith(pit, "<!--"))
+         pit = SkipPast(pit + 4, "-->");
+      else if (StartsWith(pit, "<?"))
+         pit = SkipPast(pit + 2, "?>");
+      else if (StartsWith(pit, "<!ENTITY"))
+         pit = ParseEntityDecl(pit + 8, entities);
+      else if (StartsWith(pit, "<!"))
+         pit = SkipMarkupDecl(pit + 2);
+      else if (*pit == (TChar)'%') // parameter entity reference
+         pit = SkipPast(pit, ";");
+      else
+         return nullptr;
+      if (!pit)
+         return nullptr;
+   }
+   pit = SkipSpaces(pit + 1);
+   return *pit == (TChar)'>' ? pit + 1 : nullptr;
+}
+
+// Everything in front of the root element that affects parsing
+template <typename TChar>
+struct Prolog
+{
+   const TChar *decl_begin = nullptr; // xml declaration, if present
+   const TChar *decl_end   = nullptr;
+   EntityTable<TChar> entities;       // from the internal DTD subset
+};
+
+// Parses the xml declaration, document type declaration, comments and processing instructions in front of
+// the root element. Returns pointer to the first symbol after them, or nullptr if they are malformed.
+template <typename TChar>
+const TChar *ParseProlog(const TChar *text, Prolog<TChar> *prolog)
+{
+   for (const TChar *pit = SkipSpaces(text);; pit = SkipSpaces(pit)) {
+      if (IsCommentStart(pit)) {
+         pit = SkipPast(pit + 4, "-->");
+      }
+      else if (StartsWith(pit, "<?")) {
+         const TChar *pbegin = pit;
+         pit                 = SkipPast(pit + 2, "?>");
+         if (pit && !prolog->decl_begin && StartsWith(pbegin, "<?xml") && IsSpace(pbegin[5])) {
+            prolog->decl_begin = pbegin;
+            prolog->decl_end   = pit;
+         }
+      }
+      else if (StartsWith(pit, "<!DOCTYPE")) {
+         pit = ParseDoctype(pit + 9, &prolog->entities);
+      }
+      else {
+         return pit;
+      }
+      if (!pit)
+         return nullptr;
+   }
+}
+
+// Row of EntityRefTable for 'symbol', or -1 if 'symbol' can be written as is.
+template <typename TChar>
+inline int EntityRefIndex(TChar symbol) noexcept
+{
+   switch (symbol) {
+      case (TChar)'&': return 0;
+      case (TChar)'<': return 1;
+      case (TChar)'>': return 2;
+      case (TChar)'"': return 3;
+      case (TChar)'\'': return 4;
+      default: return -1;
+   }
+}
+
+// Lengths of entity references in EntityRefTable, by row
+constexpr std::size_t ENTITY_REF_LENGTHS[] = {5, 4, 4, 6, 6};
+
+// Returns pointer to the first symbol in [pbegin, pend) that must be replaced by an entity reference, or pend
+// if there is none.
+template <typename TChar>
+const TChar *FindEscapable(const TChar *pbegin, const TChar *pend) noexcept
+{
+#ifdef XMLPARSER_SSE2
+   if constexpr (HAS_SIMD_LANES<TChar>) {
+      const __m128i amp = SplatLanes((TChar)'&'), lt = SplatLanes((TChar)'<'), gt = SplatLanes((TChar)'>'),
+                    quot = SplatLanes((TChar)'"'), apos = SplatLanes((TChar)'\'');
+      for (; pend - pbegin >= SIMD_LANES<TChar>; pbegin += SIMD_LANES<TChar>) {
+         __m128i chunk   = LoadLanes(pbegin);
+         __m128i is_ampl = _mm_or_si128(EqualLanes<TChar>(chunk, amp), EqualLanes<TChar>(chunk, lt));
+         __m128i is_rest = _mm_or_si128(EqualLanes<TChar>(chunk, gt),
+                                        _mm_or_si128(EqualLanes<TChar>(chunk, quot), EqualLanes<TChar>(chunk, apos)));
+         unsigned mask   = LaneMask(_mm_or_si128(is_ampl, is_rest));
+         if (mask) {
+            return pbegin + LowestBit(mask) / sizeof(TChar);
+         }
+      }
+   }
+#endif
+   return std::find_if(pbegin, pend, [](TChar c) { return EntityRefIndex(c) >= 0; });
+}
+
+// Length of [pbegin, pend) after replacing unallowed symbols by entity references. Counts 16 bytes at a time
+// when SSE2 is available.
+template <typename TChar>
+std::size_t EscapedLength(const TChar *pbegin, const TChar *pend) noexcept
+{
+   std::size_t length = pend - pbegin;
+#ifdef XMLPARSER_SSE2
+   if constexpr (HAS_SIMD_LANES<TChar>) {
+      const __m128i amp = SplatLanes((TChar)'&'), lt = SplatLanes((TChar)'<'), gt = SplatLanes((TChar)'>'),
+                    quot = SplatLanes((TChar)'"'), apos = SplatLanes((TChar)'\'');
+      for (; pend - pbegin >= SIMD_LANES<TChar>; pbegin += SIMD_LANES<TChar>) {
+         __m128i chunk     = LoadLanes(pbegin);
+         __m128i is_amp    = EqualLanes<TChar>(chunk, amp);
+         __m128i is_ltgt   = _mm_or_si128(EqualLanes<TChar>(chunk, lt), EqualLanes<TChar>(chunk, gt));
+         __m128i is_quotes = _mm_or_si128(EqualLanes<TChar>(chunk, quot), EqualLanes<TChar>(chunk, apos));
+         if (!LaneMask(_mm_or_si128(is_amp, _mm_or_si128(is_ltgt, is_quotes)))) {
+            continue;
+         }
+         unsigned extra = 4 * BitCount(LaneMask(is_amp)) + 3 * BitCount(LaneMask(is_ltgt)) +
+                          5 * BitCount(LaneMask(is_quotes));
+         length += extra / sizeof(TChar);
+      }
+   }
+#endif
+   for (; pbegin != pend; ++pbegin) {
+      int er_index = EntityRefIndex(*pbegin);
+      if (er_index >= 0)
+         length += ENTITY_REF_LENGTHS[er_index] - 1;
+   }
+   return length;
+}
+
+// Copies [pbegin, pend) to 'dest' replacing unallowed symbols by entity references (uses first column).
+// 'dest' must have room for EscapedLength(pbegin, pend) symbols. Returns pointer past the last written symbol.
+template <typename TChar>
+TChar *InsertEntityRef(const TChar *pbegin, const TChar *pend, TChar *dest) noexcept
+{
+   for (const TChar *pit = FindEscapable(pbegin, pend); pit != pend; pit = FindEscapable(pbegin, pend)) {
+      dest = std::copy(pbegin, pit, dest);
+
+      int er_index = EntityRefIndex(*pit);
+      dest         = std::copy_n(EntityRefTable<TChar>(er_index)[0], ENTITY_REF_LENGTHS[er_index], dest);
+      pbegin       = pit + 1;
+   }
+   return std::copy(pbegin, pend, dest);
+}
+
+// Whether 'text' contains symbols that must be replaced by entity references
+template <typename TChar>
+inline bool NeedsEscaping(std::basic_string_view<TChar> text) noexcept
+{
+   return FindEscapable(text.data(), text.data() + text.size()) != text.data() + text.size();
+}
+
+// Replaces unallowed symbols in 'content' by entity references. Counts them first, so that the result is
+// allocated once with the exact size.
+template <typename TChar>
+std::basic_string<TChar> InsertEntityRef(std::basic_string_view<TChar> content)
+{
+   const TChar *pbegin = content.data();
+   const TChar *pend   = pbegin + content.size();
+
+   std::basic_string<TChar> result(EscapedLength(pbegin, pend), TChar());
+   InsertEntityRef(pbegin, pend, &result[0]);
+   return result;
+}
+
+// Reads element name from the opening tag starting at pbegin (it must point to a '<').
+template <typename TChar>
+std::basic_string_view<TChar> ExtractName(const TChar *pbegin, const TChar *pend)
+{
+   pend = std::find_if(++pbegin, pend, [](TChar c) { return IsSpace(c) || c == (TChar)'>' || c == (TChar)'/'; });
+   return std::basic_string_view<TChar>(pbegin, pend - pbegin);
+}
+
+// Reads attribute pairs from the tag starting at pbegin (it must point to a '<'). If 'decoder' is given, entity
+// references in values are replaced; values are only copied through a temporary buffer if they contain any.
+// Sets 'escape_values' if any of the values will need escaping when written.
+template <typename TChar>
+AttrMap<TChar> ExtractAttributes(const TChar *pbegin, const TChar *pend, Interner<TChar> *interner,
+                                 EntityDecoder<TChar> *decoder, bool *escape_values)
+{
+   AttrMap<TChar> attrs;
+   std::basic_string<TChar> decoded;
+   // skip element name
+   pbegin = std::find_if(pbegin, pend, [](TChar c) { return c == (TChar)'>' || IsSpace(c); });
+
+   while (pbegin < pend) {
+      const TChar *keybegin = std::find_if(pbegin, pend, IsAlpha<TChar>);
+      if (keybegin == pend) {
+         return attrs;
+      }
+      // Spaces may surround the '=', an attribute without a quoted value ends the list
+      const TChar *keyend   = std::find(keybegin, pend, (TChar)'=');
+      const TChar *valbegin = std::find_if_not(keyend + (keyend != pend), pend, IsSpace<TChar>);
+      if (valbegin == pend || (*valbegin != (TChar)'"' && *valbegin != (TChar)'\'')) {
+         return attrs;
+      }
+      const TChar *valend = std::find(valbegin + 1, pend, *valbegin);
+      ++valbegin;
+      while (IsSpace(keyend[-1]))
+         --keyend;
+
+      std::basic_string_view<TChar> key(keybegin, keyend - keybegin);
+      std::basic_string_view<TChar> value(valbegin, valend - valbegin);
+      if (decoder && FindSymbol(valbegin, valend, (TChar)'&') != valend) {
+         decoded.clear();
+         decoder->Append(&decoded, valbegin, valend);
+         value = decoded;
+      }
+      if (!*escape_values)
+         *escape_values = NeedsEscaping(value);
+      attrs.emplace(interner->MakeName(key), interner->MakeValue(value));
+      pbegin = valend;
+   }
+   return attrs;
+}
+
+// Node in the resulting tree. Contains all data about one xml element and pointers to its children.
+template <typename TChar>
+struct ElementData
+{
+   typedef TChar char_t;
+   typedef std::basic_string<char_t> string_t;
+   typedef ElementData<char_t> my_t;
+
+   static constexpr std::size_t UNKNOWN_SIZE = static_cast<std::size_t>(-1);
+
+   ElementData() = default;
+   ElementData(const SharedString<char_t> &name, const string_t &content, const AttrMap<char_t> &attrs)
+       : name(name), content(content), attrs(attrs)
+   {}
+   // Children are destroyed in a loop rather than by the recursive destructors of std::unique_ptr, so that the
+   // depth of the tree is limited by memory only
+   ~ElementData()
+   {
+      if (children.empty())
+         return;
+      std::vector<std::unique_ptr<my_t>> pending = std::move(children);
+      while (!pending.empty()) {
+         std::unique_ptr<my_t> pnode = std::move(pending.back());
+         pending.pop_back();
+         for (auto &pchild : pnode->children)
+            pending.push_back(std::move(pchild));
+         pnode->children.clear();
+      }
+   }
+   ElementData(const ElementData &) = delete;
+   ElementData &operator=(const ElementData &) = delete;
+
+   // Deep copy, made without recursion like the destructor
+   std::unique_ptr<my_t> Copy() const
+   {
+      auto pcopy = CopyNode();
+      std::vector<std::pair<const my_t *, my_t *>> pending{{this, pcopy.get()}}; // copied elements without children
+      while (!pending.empty()) {
+         auto [psource, ptarget] = pending.back();
+         pending.pop_back();
+         ptarget->children.reserve(psource->children.size());
+         for (const auto &pchild : psource->children) {
+            ptarget->children.push_back(pchild->CopyNode());
+            ptarget->children.back()->parent = ptarget;
+            if (!pchild->children.empty())
+               pending.emplace_back(pchild.get(), ptarget->children.back().get());
+         }
+      }
+      return pcopy;
+   }
+   // Copy of the element without children
+   std::unique_ptr<my_t> CopyNode() const
+   {
+      auto pcopy            = std::make_unique<my_t>(name, content, attrs);
+      pcopy->escape_content = escape_content;
+      pcopy->escape_attrs   = escape_attrs;
+      // The copy doesn't refer to the source, so its size differs unless no source is involved
+      if (!source_end)
+         pcopy->size.store(size.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      return pcopy;
+   }
+
+   // One of these must be called after every modification of the element: MarkModified() for content and
+   // children, MarkTagModified() for name and attributes.
+   void MarkModified() noexcept
+   {
+      modified = true;
+      Invalidate();
+   }
+   void MarkTagModified() noexcept
+   {
+      tag_modified = true;
+      Invalidate();
+   }
+   // A cached size implies that the sizes of all descendants are cached too, and an ancestor of an element that
+   // isn't verbatim isn't verbatim either, so the walk stops at the first ancestor with neither.
+   void Invalidate() noexcept
+   {
+      for (my_t *pnode = this; pnode; pnode = pnode->parent) {
+         bool was_sized    = pnode->size.exchange(UNKNOWN_SIZE, std::memory_order_relaxed) != UNKNOWN_SIZE;
+         bool was_verbatim = pnode->verbatim;
+         pnode->verbatim   = false;
+         if (!was_sized && !was_verbatim)
+            break;
+      }
+   }
+
+   SharedString<char_t> name;
+   string_t content;
+   AttrMap<char_t> attrs;
+   std::vector<std::unique_ptr<my_t>> children;
+   my_t *parent = nullptr;
+
+   // Serialized length of the subtree or UNKNOWN_SIZE, see SerializedSize(). Computing the same value
+   // concurrently from several threads is harmless.
+   mutable std::atomic<std::size_t> size{UNKNOWN_SIZE};
+
+   // Whether content or attribute values may contain symbols that need escaping. Cleared when they are known
+   // not to, so that the serializer can copy them as is.
+   bool escape_content = true;
+   bool escape_attrs   = true;
+
+   // Text of the element in the source, see ParseOptions::keep_source. The end is set only for complete elements.
+   const char_t *source_begin = nullptr;
+   const char_t *source_end   = nullptr;
+   // Whether content or the list of children changed since parsing
+   bool modified = false;
+   // Whether name or attributes changed since parsing
+   bool tag_modified = false;
+   // Whether the whole subtree is unchanged, so that its source can be copied
+   bool verbatim = false;
+};
+
+template <typename TChar>
+std::size_t TextSize(std::basic_string_view<TChar> text, bool escape) noexcept
+{
+   return escape ? EscapedLength(text.data(), text.data() + text.size()) : text.size();
+}
+
+// Exact length of the output of Serializer::WriteDeclaration()
+template <typename TChar>
+std::size_t DeclarationSize(const std::basic_string<TChar> &version, const std::basic_string<TChar> &encoding,
+                            const std::basic_string<TChar> &standalone) noexcept
+{
+   if (version.empty() && encoding.empty() && standalone.empty())
+      return 0;
+
+   const std::size_t attr_markup = MarkupTable<TChar>(Markup::ATTR_START).size() +
+                                   MarkupTable<TChar>(Markup::ATTR_MID).size() +
+                                   MarkupTable<TChar>(Markup::ATTR_END).size();
+   const std::basic_string<TChar> *decl_attrs  = DeclarationAttrs<TChar>();
+   const std::basic_string<TChar> *decl_data[] = {&version, &encoding, &standalone};
+
+   std::size_t size = MarkupTable<TChar>(Markup::DECL_START).size() + MarkupTable<TChar>(Markup::DECL_END).size();
+   for (int i = 0; i < 3; ++i) {
+      if (!decl_data[i]->empty())
+         size += attr_markup + decl_attrs[i].size() + decl_data[i]->size();
+   }
+   return size;
+}
+
+// Whether the source of 'e' can be copied, with its start and end tags regenerated if 'regenerate_tags'. An
+// element written as <name/> in the source has no end tag to regenerate.
+template <typename TChar>
+bool CanCopySource(const ElementData<TChar> &e, bool regenerate_tags) noexcept
+{
+   return e.source_end && !e.modified && !(regenerate_tags && e.source_end[-2] == (TChar)'/');
+}
+
+// End of the start tag of 'e' in the source
+template <typename TChar>
+const TChar *SourceStartTagEnd(const ElementData<TChar> &e) noexcept
+{
+   return FindTagEnd(e.source_begin + 1, e.source_end) + 1;
+}
+
+// Beginning of the end tag of 'e' in the source, which must have one
+template <typename TChar>
+const TChar *SourceEndTag(const ElementData<TChar> &e) noexcept
+{
+   const TChar *pit = e.source_end - 1;
+   while (*pit != (TChar)'<')
+      --pit;
+   return pit;
+}
+
+// Length of '<', name and attributes of 'e'
+template <typename TChar>
+std::size_t OpeningTagSize(const ElementData<TChar> &e) noexcept
+{
+   const std::size_t attr_markup = MarkupTable<TChar>(Markup::ATTR_START).size() +
+                                   MarkupTable<TChar>(Markup::ATTR_MID).size() +
+                                   MarkupTable<TChar>(Markup::ATTR_END).size();
+
+   std::size_t size = MarkupTable<TChar>(Markup::OPENING_TAG_START).size();
+   size += std::basic_string_view<TChar>(e.name).size();
+   for (const auto &attr : e.attrs) {
+      size += attr_markup + std::basic_string_view<TChar>(attr.first).size() +
+              TextSize<TChar>(attr.second, e.escape_attrs);
+   }
+   return size;
+}
+
+// Length of the end tag of 'e'
+template <typename TChar>
+std::size_t ClosingTagSize(const ElementData<TChar> &e) noexcept
+{
+   return MarkupTable<TChar>(Markup::CLOSING_TAG_START).size() + std::basic_string_view<TChar>(e.name).size() +
+          MarkupTable<TChar>(Markup::CLOSING_TAG_END).size();
+}
+
+// Calls 'enter' for each element of the subtree of 'root' in document order, and 'leave' after the children of
+// each element for which 'enter' returned true, i.e. whose children were visited. Open elements are kept on a
+// heap-allocated stack instead of the call stack, so that the depth of the tree is limited by memory only.
+template <typename TChar, typename TEnter, typename TLeave>
+void VisitTree(const ElementData<TChar> &root, TEnter &&enter, TLeave &&leave)
+{
+   if (!enter(root))
+      return;
+   std::vector<std::pair<const ElementData<TChar> *, std::size_t>> open{{&root, 0}}; // element, next child
+   while (!open.empty()) {
+      auto &top = open.back();
+      if (top.second == top.first->children.size()) {
+         const ElementData<TChar> &e = *top.first;
+         open.pop_back();
+         leave(e);
+      }
+      else {
+         const ElementData<TChar> &child = *top.first->children[top.second++];
+         if (enter(child))
+            open.emplace_back(&child, 0);
+      }
+   }
+}
+
+// Exact length of the output of Serializer::WriteElement(). Results are cached in the elements.
+template <typename TChar>
+std::size_t SerializedSize(const ElementData<TChar> &root)
+{
+   std::size_t size = root.size.load(std::memory_order_relaxed);
+   if (size != ElementData<TChar>::UNKNOWN_SIZE)
+      return size;
+
+   struct Frame
+   {
+      std::size_t size;  // of the element itself plus its children visited so far
+      bool copy_source;  // whether children replace their source in the element's source
+   };
+   std::vector<Frame> open;
+   // Adds the size of a complete child to its parent
+   auto add = [&open, &size](const ElementData<TChar> &e, std::size_t e_size) {
+      e.size.store(e_size, std::memory_order_relaxed);
+      if (open.empty())
+         size = e_size;
+      else if (open.back().copy_source)
+         open.back().size += e_size - (e.source_end - e.source_begin); // same as Serializer::WriteElement()
+      else
+         open.back().size += e_size;
+   };
+   auto enter = [&open, &add](const ElementData<TChar> &e) {
+      std::size_t e_size = e.size.load(std::memory_order_relaxed);
+      if (e_size != ElementData<TChar>::UNKNOWN_SIZE) {
+         add(e, e_size);
+         return false;
+      }
+      bool copy_source = CanCopySource(e, e.tag_modified);
+      if (copy_source) {
+         e_size = e.source_end - e.source_begin;
+         if (e.tag_modified) {
+            e_size -= (SourceStartTagEnd(e) - e.source_begin) + (e.source_end - SourceEndTag(e));
+            e_size += OpeningTagSize(e) + MarkupTable<TChar>(Markup::OPENING_TAG_END).size() + ClosingTagSize(e);
+         }
+      }
+      else if (e.content.empty() && e.children.empty()) {
+         e_size = OpeningTagSize(e) + MarkupTable<TChar>(Markup::SINGLE_TAG_END).size();
+      }
+      else {
+         e_size = OpeningTagSize(e) + MarkupTable<TChar>(Markup::OPENING_TAG_END).size() +
+                  TextSize<TChar>(e.content, e.escape_content) + ClosingTagSize(e);
+      }
+      if (e.children.empty() || (copy_source && e.verbatim)) {
+         add(e, e_size);
+         return false;
+      }
+      open.push_back({e_size, copy_source});
+      return true;
+   };
+   auto leave = [&open, &add](const ElementData<TChar> &e) {
+      std::size_t e_size = open.back().size;
+      open.pop_back();
+      add(e, e_size);
+   };
+   VisitTree(root, enter, leave);
+   return size;
+}
+
+// Passes 'text' to 'write' as runs of symbols that don't need escaping alternating with entity references
+template <typename TChar, typename TWrite>
+void WriteEscaped(std::basic_string_view<TChar> text, TWrite &&write)
+{
+   const TChar *pbegin = text.data();
+   const TChar *pend   = pbegin + text.size();
+   for (const TChar *pit = FindEscapable(pbegin, pend); pit != pend; pit = FindEscapable(pbegin, pend)) {
+      int er_index = EntityRefIndex(*pit);
+      write(pbegin, static_cast<std::size_t>(pit - pbegin));
+      write(EntityRefTable<TChar>(er_index)[0], ENTITY_REF_LENGTHS[er_index]);
+      pbegin = pit + 1;
+   }
+   write(pbegin, static_cast<std::size_t>(pend - pbegin));
+}
+
+// Namespace declarations (xmlns and xmlns:* attributes) of the ancestors of 'e' that are in scope for it, i.e.
+// not redeclared by 'e' itself or by a closer ancestor
+template <typename TChar>
+AttrMap<TChar> InheritedNamespaces(const ElementData<TChar> &e)
+{
+   static const TChar xmlns[] = {'x', 'm', 'l', 'n', 's'};
+   const std::basic_string_view<TChar> prefix(xmlns, 5);
+
+   AttrMap<TChar> namespaces;
+   for (const ElementData<TChar> *pnode = e.parent; pnode; pnode = pnode->parent) {
+      for (const auto &attr : pnode->attrs) {
+         std::basic_string_view<TChar> name = attr.first;
+         if (name.substr(0, 5) != prefix || (name.size() > 5 && name[5] != (TChar)':'))
+            continue;
+         if (e.attrs.find(name) == e.attrs.end() && namespaces.find(name) == namespaces.end())
+            namespaces.emplace(attr.first, attr.second);
+      }
+   }
+   return namespaces;
+}
+
+// Detects sinks that can keep references to data instead of copying it, see xml::FdSink
+template <typename TSink, typename = void>
+struct HasWriteStable : std::false_type
+{};
+template <typename TSink>
+struct HasWriteStable<TSink, std::void_t<decltype(std::declval<TSink &>().WriteStable(nullptr, 0))>>
+    : std::true_type
+{};
+
+// Writes xml declaration and element trees to a sink, see xml::StringSink. Everything passed to WriteStable() is
+// either part of the tree or of static tables, so it stays valid while the tree is not modified. Attributes added
+// for this call only, like inherited namespace declarations, are always copied.
+template <typename TChar, typename TSink>
+class Serializer
+{
+public:
+   typedef std::basic_string<TChar> string_t;
+   typedef std::basic_string_view<TChar> view_t;
+
+   explicit Serializer(TSink *sink, const WriteOptions &options = WriteOptions()) : sink_(sink), options_(options)
+   {
+      if (options_.pretty) {
+         if (options_.crlf)
+            indent_.push_back((TChar)'\r');
+         indent_.push_back((TChar)'\n');
+         newline_size_ = indent_.size();
+         indent_.resize(newline_size_ + PREBUILT_LEVELS * options_.indent_width, (TChar)' ');
+      }
+   }
+
+   // Writes nothing if all values are empty
+   void WriteDeclaration(const string_t &version, const string_t &encoding, const string_t &standalone)
+   {
+      if (version.empty() && encoding.empty() && standalone.empty())
+         return;
+
+      Write(Markup::DECL_START);
+      const string_t *decl_attrs  = DeclarationAttrs<TChar>();
+      const string_t *decl_data[] = {&version, &encoding, &standalone};
+      for (int i = 0; i < 3; ++i) {
+         if (!decl_data[i]->empty()) {
+            Write(Markup::ATTR_START);
+            Write(decl_attrs[i]);
+            Write(Markup::ATTR_MID);
+            Write(*decl_data[i]);
+            Write(Markup::ATTR_END);
+         }
+      }
+      Write(Markup::DECL_END);
+      if (options_.pretty)
+         WriteIndent(0);
+   }
+
+   // Attributes in 'pextra' are written before the element's own ones. The source of elements is copied where
+   // possible, see CanCopySource(), with children that aren't verbatim written separately in the gaps.
+   void WriteElement(const ElementData<TChar> &e, std::size_t depth = 0, const AttrMap<TChar> *pextra = nullptr)
+   {
+      // For each open element, where copying its source continues, or nullptr if it's regenerated
+      std::vector<const TChar *> gaps;
+      auto enter = [&](const ElementData<TChar> &elem) {
+         const AttrMap<TChar> *pattrs = gaps.empty() ? pextra : nullptr;
+         const std::size_t level      = depth + gaps.size();
+         if (!gaps.empty() && gaps.back()) {
+            Write(gaps.back(), elem.source_begin - gaps.back());
+            gaps.back() = elem.source_end;
+         }
+         else if (!gaps.empty() && options_.pretty) {
+            WriteIndent(level);
+         }
+         if (!options_.pretty && CanCopySource(elem, elem.tag_modified || pattrs)) {
+            const TChar *pgap = WriteSourceStart(elem, pattrs);
+            if (elem.verbatim || elem.children.empty()) {
+               WriteSourceEnd(elem, pgap, pattrs);
+               return false;
+            }
+            gaps.push_back(pgap);
+            return true;
+         }
+         if (!WriteStartTag(elem, level, pattrs))
+            return false;
+         gaps.push_back(nullptr);
+         return true;
+      };
+      auto leave = [&](const ElementData<TChar> &elem) {
+         const TChar *pgap = gaps.back();
+         gaps.pop_back();
+         if (pgap)
+            WriteSourceEnd(elem, pgap, gaps.empty() ? pextra : nullptr);
+         else
+            WriteEndTag(elem, depth + gaps.size());
+      };
+      VisitTree(e, enter, leave);
+   }
+   // Writes the start tag and content. Returns false if the element has been written completely, as <name />.
+   bool WriteStartTag(const ElementData<TChar> &e, std::size_t depth, const AttrMap<TChar> *pextra = nullptr)
+   {
+      WriteOpeningTag(e, depth, pextra);
+      if (e.content.empty() && e.children.empty()) {
+         Write(Markup::SINGLE_TAG_END);
+         return false;
+      }
+      Write(Markup::OPENING_TAG_END);
+      WriteText(e.content, e.escape_content);
+      return true;
+   }
+   // Writes the start tag, regenerated if needed. Returns where copying the source continues.
+   const TChar *WriteSourceStart(const ElementData<TChar> &e, const AttrMap<TChar> *pextra = nullptr)
+   {
+      if (!e.tag_modified && !pextra)
+         return e.source_begin;
+      WriteOpeningTag(e, 0, pextra);
+      Write(Markup::OPENING_TAG_END);
+      return SourceStartTagEnd(e);
+   }
+   // Copies the source from 'pgap' to the end, regenerating the end tag if needed
+   void WriteSourceEnd(const ElementData<TChar> &e, const TChar *pgap, const AttrMap<TChar> *pextra = nullptr)
+   {
+      if (!e.tag_modified && !pextra) {
+         Write(pgap, e.source_end - pgap);
+         return;
+      }
+      const TChar *pend_tag = SourceEndTag(e);
+      Write(pgap, pend_tag - pgap);
+      Write(Markup::CLOSING_TAG_START);
+      Write(e.name);
+      Write(Markup::CLOSING_TAG_END);
+   }
+   void WriteEndTag(const ElementData<TChar> &e, std::size_t depth)
+   {
+      if (options_.pretty && !e.children.empty())
+         WriteIndent(depth);
+      Write(Markup::CLOSING_TAG_START);
+      Write(e.name);
+      Write(Markup::CLOSING_TAG_END);
+   }
+
+private:
+   void WriteOpeningTag(const ElementData<TChar> &e, std::size_t depth, const AttrMap<TChar> *pextra)
+   {
+      Write(Markup::OPENING_TAG_START);
+      Write(e.name);
+      if (pextra) {
+         stable_ = false; // 'pextra' may be gone before the sink is flushed
+         WriteAttributes(*pextra, true, depth);
+         stable_ = true;
+      }
+      WriteAttributes(e.attrs, e.escape_attrs, depth);
+   }
+   void WriteAttributes(const AttrMap<TChar> &attrs, bool escape, std::size_t depth)
+   {
+      for (const auto &attr : attrs) {
+         if (options_.pretty && options_.wrap_attributes)
+            WriteIndent(depth + 1);
+         else
+            Write(Markup::ATTR_START);
+         Write(attr.first);
+         Write(Markup::ATTR_MID);
+         WriteText(attr.second, escape);
+         Write(Markup::ATTR_END);
+      }
+   }
+   void Write(const TChar *data, std::size_t size)
+   {
+      if constexpr (HasWriteStable<TSink>::value) {
+         if (stable_)
+            sink_->WriteStable(data, size);
+         else
+            sink_->Write(data, size);
+      }
+      else {
+         sink_->Write(data, size);
+      }
+   }
+   void Write(view_t text)
+   {
+      Write(text.data(), text.size());
+   }
+   void Write(Markup markup)
+   {
+      Write(MarkupTable<TChar>(markup));
+   }
+   // Writes 'text' replacing unallowed symbols by entity references, unless it's known to contain none
+   void WriteText(view_t text, bool escape)
+   {
+      if (escape)
+         WriteEscaped(text, [this](const TChar *data, std::size_t size) { Write(data, size); });
+      else
+         Write(text);
+   }
+   // Writes a line break followed by the indentation for 'depth', taken from the prebuilt string. Deeper levels
+   // grow the string, so the output is always copied rather than passed to WriteStable().
+   void WriteIndent(std::size_t depth)
+   {
+      std::size_t size = newline_size_ + depth * options_.indent_width;
+      if (size > indent_.size())
+         indent_.resize(std::max(size, 2 * indent_.size()), (TChar)' ');
+      sink_->Write(indent_.data(), size);
+   }
+
+   static constexpr std::size_t PREBUILT_LEVELS = 16;
+
+   TSink *sink_;
+   WriteOptions options_;
+   string_t indent_; // line break followed by spaces
+   std::size_t newline_size_ = 0;
+   bool stable_              = true; // whether the data being written outlives the sink's buffer
+};
+
+// Copies output to consecutive positions of a preallocated buffer
+template <typename TChar>
+struct PointerSink
+{
+   void Write(const TChar *data, std::size_t size) noexcept
+   {
+      std::char_traits<TChar>::copy(pos, data, size);
+      pos += size;
+   }
+   TChar *pos;
+};
+
+// Subtree to serialize starting at 'pdest'
+template <typename TChar>
+struct SerializeTask
+{
+   const ElementData<TChar> *pelem;
+   TChar *pdest;
+};
+
+// Writes tags of elements larger than 'grain' to 'psink' and adds their children to 'tasks'. Smaller subtrees
+// become tasks as a whole. Each task gets the position where its output starts, known from SerializedSize().
+template <typename TChar>
+void PlanSerialization(const ElementData<TChar> &root, std::size_t grain, PointerSink<TChar> *psink,
+                       std::vector<SerializeTask<TChar>> *ptasks)
+{
+   Serializer<TChar, PointerSink<TChar>> serializer(psink);
+   // Same as in Serializer::WriteElement()
+   std::vector<const TChar *> gaps;
+   auto enter = [&](const ElementData<TChar> &e) {
+      if (!gaps.empty() && gaps.back()) {
+         psink->Write(gaps.back(), e.source_begin - gaps.back());
+         gaps.back() = e.source_end;
+      }
+      if (e.children.empty() || e.verbatim || SerializedSize(e) <= grain) {
+         ptasks->push_back({&e, psink->pos});
+         psink->pos += SerializedSize(e);
+         return false;
+      }
+      if (CanCopySource(e, e.tag_modified)) {
+         gaps.push_back(serializer.WriteSourceStart(e));
+      }
+      else {
+         serializer.WriteStartTag(e, 0);
+         gaps.push_back(nullptr);
+      }
+      return true;
+   };
+   auto leave = [&](const ElementData<TChar> &e) {
+      if (gaps.back())
+         serializer.WriteSourceEnd(e, gaps.back());
+      else
+         serializer.WriteEndTag(e, 0);
+      gaps.pop_back();
+   };
+   VisitTree(root, enter, leave);
+}
+
+// Serializes 'root' into 'pdest', which must have room for SerializedSize(root) symbols. The tree is split into
+// subtrees of similar size, which are written by 'threads' threads directly to their final positions, so the
+// output is identical to that of a single Serializer.
+template <typename TChar>
+void SerializeParallel(const ElementData<TChar> &root, TChar *pdest, std::size_t threads)
+{
+   // Caches the sizes of all elements before the threads read them
+   const std::size_t total = SerializedSize(root);
+   const std::size_t grain = std::max<std::size_t>(total / (threads * 8), 1 << 16);
+
+   PointerSink<TChar> sink{pdest};
+   std::vector<SerializeTask<TChar>> tasks;
+   PlanSerialization(root, grain, &sink, &tasks);
+
+   std::atomic<std::size_t> next{0};
+   auto work = [&tasks, &next]() noexcept {
+      for (std::size_t i = next++; i < tasks.size(); i = next++) {
+         PointerSink<TChar> task_sink{tasks[i].pdest};
+         Serializer<TChar, PointerSink<TChar>>(&task_sink).WriteElement(*tasks[i].pelem);
+      }
+   };
+   std::vector<std::thread> workers;
+   try {
+      for (std::size_t i = 1; i < std::min(threads, tasks.size()); ++i)
+         workers.emplace_back(work);
+   }
+   catch (const std::system_error &) {
+      // Fewer threads, the remaining tasks are taken by the others
+   }
+   work();
+   for (auto &worker : workers)
+      worker.join();
+}
+
+#ifdef XMLPARSER_SSE2
+
+// Stores the 16 symbols at 'pit' to 'pout' as bytes if all of them are ascii, otherwise returns false and writes
+// nothing. The values are narrowed with saturating packs, which keep ascii as it is.
+template <typename TChar>
+inline bool PackAscii(const TChar *pit, char *pout) noexcept
+{
+   __m128i packed;
+   if constexpr (sizeof(TChar) == 2) {
+      __m128i low  = LoadLanes(pit);
+      __m128i high = LoadLanes(pit + 8);
+      __m128i bits = _mm_and_si128(_mm_or_si128(low, high), _mm_set1_epi16(static_cast<short>(0xFF80)));
+      if (LaneMask(_mm_cmpeq_epi8(bits, _mm_setzero_si128())) != 0xFFFF)
+         return false;
+      packed = _mm_packus_epi16(low, high);
+   }
+   else {
+      __m128i lanes[] = {LoadLanes(pit), LoadLanes(pit + 4), LoadLanes(pit + 8), LoadLanes(pit + 12)};
+      __m128i bits    = _mm_or_si128(_mm_or_si128(lanes[0], lanes[1]), _mm_or_si128(lanes[2], lanes[3]));
+      bits            = _mm_and_si128(bits, _mm_set1_epi32(-0x80));
+      if (LaneMask(_mm_cmpeq_epi8(bits, _mm_setzero_si128())) != 0xFFFF)
+         return false;
+      packed = _mm_packus_epi16(_mm_packs_epi32(lanes[0], lanes[1]), _mm_packs_epi32(lanes[2], lanes[3]));
+   }
+   _mm_storeu_si128(reinterpret_cast<__m128i *>(pout), packed);
+   return true;
+}
+
+#endif // XMLPARSER_SSE2
+
+// Converts UTF-16 (16-bit TChar) or UTF-32 (wider TChar) to UTF-8. Unpaired surrogates and values beyond
+// U+10FFFF become U+FFFD. A high surrogate at the end of the input is kept until the next call, so the input may
+// be split anywhere. Runs of ascii are converted 16 symbols at a time when SSE2 is available.
+template <typename TChar>
+class Utf8Encoder
+{
+public:
+   // Longest output for one symbol, not counting U+FFFD written for a pending high surrogate
+   static constexpr std::size_t MAX_SYMBOL_SIZE = sizeof(TChar) == 2 ? 3 : 4;
+
+   // Upper bound of the output of Encode() for 'size' symbols, including a pending high surrogate
+   static constexpr std::size_t MaxSize(std::size_t size) noexcept
+   {
+      return MAX_SYMBOL_SIZE * size + 3;
+   }
+
+   // Writes [pit, pend) as UTF-8 to 'pout', which must have room for MaxSize(pend - pit) bytes. Returns the end
+   // of the output.
+   char *Encode(const TChar *pit, const TChar *pend, char *pout) noexcept
+   {
+      while (pit != pend) {
+#ifdef XMLPARSER_SSE2
+         if constexpr (sizeof(TChar) == 2 || sizeof(TChar) == 4) {
+            for (; pend - pit >= 16 && !high_surrogate_ && PackAscii(pit, pout); pit += 16)
+               pout += 16;
+         }
+#endif
+         // The rest of a block with non-ascii symbols
+         const TChar *pblock_end = pit + std::min<std::ptrdiff_t>(pend - pit, 16);
+         for (; pit != pblock_end; ++pit)
+            pout = EncodeSymbol(static_cast<std::make_unsigned_t<TChar>>(*pit), pout);
+      }
+      return pout;
+   }
+   // Writes U+FFFD for a pending high surrogate, at most 3 bytes. Returns the end of the output.
+   char *Finish(char *pout) noexcept
+   {
+      if (high_surrogate_)
+         pout = WriteCodePoint(0xFFFD, pout);
+      high_surrogate_ = 0;
+      return pout;
+   }
+
+private:
+   char *EncodeSymbol(char32_t code, char *pout) noexcept
+   {
+      if constexpr (sizeof(TChar) == 2) {
+         if (high_surrogate_) {
+            if (code >= 0xDC00 && code <= 0xDFFF) {
+               code            = 0x10000 + ((high_surrogate_ - 0xD800) << 10) + (code - 0xDC00);
+               high_surrogate_ = 0;
+               return WriteCodePoint(code, pout);
+            }
+            pout            = WriteCodePoint(0xFFFD, pout);
+            high_surrogate_ = 0;
+         }
+         if (code >= 0xD800 && code <= 0xDBFF) {
+            high_surrogate_ = code;
+            return pout;
+         }
+      }
+      if (code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF))
+         code = 0xFFFD;
+      return WriteCodePoint(code, pout);
+   }
+   static char *WriteCodePoint(char32_t code, char *pout) noexcept
+   {
+      if (code < 0x80) {
+         *pout++ = static_cast<char>(code);
+      }
+      else if (code < 0x800) {
+         *pout++ = static_cast<char>(0xC0 | (code >> 6));
+         *pout++ = static_cast<char>(0x80 | (code & 0x3F));
+      }
+      else if (code < 0x10000) {
+         *pout++ = static_cast<char>(0xE0 | (code >> 12));
+         *pout++ = static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+         *pout++ = static_cast<char>(0x80 | (code & 0x3F));
+      }
+      else {
+         *pout++ = static_cast<char>(0xF0 | (code >> 18));
+         *pout++ = static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+         *pout++ = static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+         *pout++ = static_cast<char>(0x80 | (code & 0x3F));
+      }
+      return pout;
+   }
+
+   char32_t high_surrogate_ = 0;
+};
+
+// Converts UTF-8 'text' of 'size' bytes to UTF-16 (16-bit TChar) or UTF-32 (wider TChar) at 'pout', which must
+// have room for 'size' symbols. Invalid and overlong sequences become U+FFFD, one per byte. Returns the end of the
+// output.
+template <typename TChar>
+TChar *DecodeUtf8(const char *text, std::size_t size, TChar *pout) noexcept
+{
+   static const char32_t minimum[] = {0, 0, 0x80, 0x800, 0x10000}; // by sequence length
+
+   const unsigned char *pit  = reinterpret_cast<const unsigned char *>(text);
+   const unsigned char *pend = pit + size;
+   while (pit != pend) {
+      if (*pit < 0x80) {
+         *pout++ = static_cast<TChar>(*pit++);
+         continue;
+      }
+      std::size_t length = *pit >= 0xF0 ? 4 : *pit >= 0xE0 ? 3 : 2;
+      char32_t code      = *pit & (0x3F >> (length - 1));
+      bool valid         = *pit >= 0xC2 && *pit <= 0xF4 && static_cast<std::size_t>(pend - pit) >= length;
+      for (std::size_t i = 1; valid && i < length; ++i) {
+         valid = (pit[i] & 0xC0) == 0x80;
+         code  = (code << 6) | (pit[i] & 0x3F);
+      }
+      if (!valid || code < minimum[length] || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF)) {
+         code   = 0xFFFD;
+         length = 1;
+      }
+      pit += length;
+      if (sizeof(TChar) == 2 && code >= 0x10000) {
+         code -= 0x10000;
+         *pout++ = static_cast<TChar>(0xD800 | (code >> 10));
+         *pout++ = static_cast<TChar>(0xDC00 | (code & 0x3FF));
+      }
+      else {
+         *pout++ = static_cast<TChar>(code);
+      }
+   }
+   return pout;
+}
+
+// SHA-256 message digest (FIPS 180-4), computed incrementally
+class Sha256
+{
+public:
+   typedef std::array<unsigned char, 32> digest_t;
+
+   Sha256() noexcept
+   {
+      Reset();
+   }
+   void Update(const void *data, std::size_t size) noexcept
+   {
+      const unsigned char *pdata = static_cast<const unsigned char *>(data);
+      length_ += size;
+      if (used_ > 0) {
+         std::size_t count = std::min(size, sizeof(block_) - used_);
+         std::memcpy(block_ + used_, pdata, count);
+         used_ += count;
+         pdata += count;
+         size -= count;
+         if (used_ < sizeof(block_))
+            return;
+         Transform(block_);
+         used_ = 0;
+      }
+      for (; size >= sizeof(block_); pdata += sizeof(block_), size -= sizeof(block_))
+         Transform(pdata);
+      std::memcpy(block_, pdata, size);
+      used_ = size;
+   }
+   // Same as Update(), so that the digest can be used as a sink of bytes
+   void Write(const char *data, std::size_t size) noexcept
+   {
+      Update(data, size);
+   }
+   // Returns the digest of all data passed to Update() and starts over
+   digest_t Final() noexcept
+   {
+      std::uint64_t bits = length_ * 8;
+      block_[used_++]    = 0x80;
+      if (used_ > sizeof(block_) - 8) {
+         std::memset(block_ + used_, 0, sizeof(block_) - used_);
+         Transform(block_);
+         used_ = 0;
+      }
+      std::memset(block_ + used_, 0, sizeof(block_) - 8 - used_);
+      for (int i = 0; i < 8; ++i)
+         block_[sizeof(block_) - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+      Transform(block_);
+
+      digest_t digest;
+      for (int i = 0; i < 32; ++i)
+         digest[i] = static_cast<unsigned char>(state_[i / 4] >> (24 - 8 * (i % 4)));
+      Reset();
+      return digest;
+   }
+
+private:
+   void Reset() noexcept
+   {
+      static constexpr std::uint32_t INITIAL[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+      std::copy(INITIAL, INITIAL + 8, state_);
+      used_   = 0;
+      length_ = 0;
+   }
+   static std::uint32_t Rotr(std::uint32_t x, int n) noexcept
+   {
+      return (x >> n) | (x << (32 - n));
+   }
+   void Transform(const unsigned char *pblock) noexcept
+   {
+      static constexpr std::uint32_t K[64] = {
+          0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+          0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+          0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+          0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+          0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+          0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+          0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+          0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+      std::uint32_t w[64];
+      for (int i = 0; i < 16; ++i)
+         w[i] = (std::uint32_t(pblock[4 * i]) << 24) | (std::uint32_t(pblock[4 * i + 1]) << 16) |
+                (std::uint32_t(pblock[4 * i + 2]) << 8) | std::uint32_t(pblock[4 * i + 3]);
+      for (int i = 16; i < 64; ++i) {
+         std::uint32_t s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+         std::uint32_t s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+         w[i]             = w[i - 16] + s0 + w[i - 7] + s1;
+      }
+
+      std::uint32_t v[8];
+      std::copy(state_, state_ + 8, v);
+      for (int i = 0; i < 64; ++i) {
+         std::uint32_t s1 = Rotr(v[4], 6) ^ Rotr(v[4], 11) ^ Rotr(v[4], 25);
+         std::uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+         std::uint32_t t1 = v[7] + s1 + ch + K[i] + w[i];
+         std::uint32_t s0 = Rotr(v[0], 2) ^ Rotr(v[0], 13) ^ Rotr(v[0], 22);
+         std::uint32_t mj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+         std::copy_backward(v, v + 7, v + 8);
+         v[4] += t1;
+         v[0] = t1 + s0 + mj;
+      }
+      for (int i = 0; i < 8; ++i)
+         state_[i] += v[i];
+   }
+
+   std::uint32_t state_[8];
+   unsigned char block_[64];
+   std::size_t used_;
+   std::uint64_t length_; // in bytes
+};
+
+// Writes element trees as Canonical XML 1.0 (https://www.w3.org/TR/xml-c14n), so that logically equal trees
+// produce identical output:
+// - empty elements are written as start-end tag pairs;
+// - namespace declarations come first, sorted by prefix, and are omitted if an ancestor already declares the
+//   same namespace;
+// - other attributes are sorted by namespace URI, then by local name. Prefixes declared nowhere in scope are
+//   ordered as if they were the URI;
+// - text and attribute values are escaped as required by C14N, including line breaks and tabs in values.
+template <typename TChar, typename TSink>
+class CanonicalSerializer
+{
+public:
+   typedef std::basic_string_view<TChar> view_t;
+
+   explicit CanonicalSerializer(TSink *sink) : sink_(sink)
+   {}
+
+   void WriteElement(const ElementData<TChar> &root)
+   {
+      std::vector<std::size_t> scope_marks; // size of 'scope_' before each open element
+      auto enter = [this, &scope_marks](const ElementData<TChar> &e) {
+         scope_marks.push_back(scope_.size());
+         WriteStartTag(e);
+         return true;
+      };
+      auto leave = [this, &scope_marks](const ElementData<TChar> &e) {
+         Write(MarkupTable<TChar>(Markup::CLOSING_TAG_START));
+         Write(e.name);
+         Write(MarkupTable<TChar>(Markup::CLOSING_TAG_END));
+         scope_.resize(scope_marks.back());
+         scope_marks.pop_back();
+      };
+      VisitTree(root, enter, leave);
+   }
+
+private:
+   struct Namespace
+   {
+      view_t prefix;
+      view_t uri;
+   };
+   struct AttrKey
+   {
+      view_t uri;
+      view_t local;
+      std::size_t index; // in 'attrs_'
+   };
+
+   // Writes the start tag and content, adding the namespaces that 'e' declares to the scope
+   void WriteStartTag(const ElementData<TChar> &e)
+   {
+      const std::size_t scope_mark = scope_.size();
+      attrs_.clear();
+      for (const auto &attr : e.attrs) {
+         view_t name = attr.first;
+         if (name.substr(0, 5) == Xmlns() && (name.size() == 5 || name[5] == (TChar)':')) {
+            view_t prefix = name.size() > 5 ? name.substr(6) : view_t();
+            view_t uri    = attr.second;
+            view_t in_scope;
+            bool declared = FindNamespace(prefix, scope_mark, &in_scope);
+            if (declared ? in_scope != uri : !(prefix.empty() && uri.empty()))
+               scope_.push_back({prefix, uri});
+         }
+         else {
+            attrs_.push_back(&attr);
+         }
+      }
+      std::sort(scope_.begin() + scope_mark, scope_.end(),
+                [](const Namespace &lhs, const Namespace &rhs) { return lhs.prefix < rhs.prefix; });
+
+      // Attribute names are split into URI and local name once, before sorting
+      keys_.clear();
+      for (std::size_t i = 0; i < attrs_.size(); ++i) {
+         view_t name       = attrs_[i]->first;
+         std::size_t colon = name.find((TChar)':');
+         if (colon == name.npos) {
+            keys_.push_back({view_t(), name, i});
+            continue;
+         }
+         view_t prefix = name.substr(0, colon);
+         view_t uri;
+         if (!FindNamespace(prefix, scope_.size(), &uri))
+            uri = prefix == Xmlns().substr(0, 3) ? XmlNamespace() : prefix;
+         keys_.push_back({uri, name.substr(colon + 1), i});
+      }
+      std::sort(keys_.begin(), keys_.end(), [](const AttrKey &lhs, const AttrKey &rhs) {
+         return lhs.uri < rhs.uri || (lhs.uri == rhs.uri && lhs.local < rhs.local);
+      });
+
+      Write(MarkupTable<TChar>(Markup::OPENING_TAG_START));
+      Write(e.name);
+      for (std::size_t i = scope_mark; i < scope_.size(); ++i) {
+         Write(MarkupTable<TChar>(Markup::ATTR_START));
+         Write(Xmlns());
+         if (!scope_[i].prefix.empty()) {
+            TChar colon = (TChar)':';
+            sink_->Write(&colon, 1);
+            Write(scope_[i].prefix);
+         }
+         Write(MarkupTable<TChar>(Markup::ATTR_MID));
+         WriteEscaped(scope_[i].uri, true);
+         Write(MarkupTable<TChar>(Markup::ATTR_END));
+      }
+      for (const AttrKey &key : keys_) {
+         Write(MarkupTable<TChar>(Markup::ATTR_START));
+         Write(attrs_[key.index]->first);
+         Write(MarkupTable<TChar>(Markup::ATTR_MID));
+         WriteEscaped(attrs_[key.index]->second, true);
+         Write(MarkupTable<TChar>(Markup::ATTR_END));
+      }
+      Write(MarkupTable<TChar>(Markup::OPENING_TAG_END));
+      WriteEscaped(e.content, false);
+   }
+
+   static view_t Xmlns() noexcept
+   {
+      static const TChar xmlns[] = {'x', 'm', 'l', 'n', 's'};
+      return view_t(xmlns, 5);
+   }
+   static view_t XmlNamespace() noexcept
+   {
+      static const TChar uri[] = {'h', 't', 't', 'p', ':', '/', '/', 'w', 'w', 'w', '.', 'w', '3', '.', 'o', 'r',
+                                  'g', '/', 'X', 'M', 'L', '/', '1', '9', '9', '8', '/', 'n', 'a', 'm', 'e', 's',
+                                  'p', 'a', 'c', 'e'};
+      return view_t(uri, sizeof(uri) / sizeof(TChar));
+   }
+
+   // Looks for the URI of 'prefix' among the first 'count' declarations in scope
+   bool FindNamespace(view_t prefix, std::size_t count, view_t *puri) const noexcept
+   {
+      for (std::size_t i = count; i > 0; --i) {
+         if (scope_[i - 1].prefix == prefix) {
+            *puri = scope_[i - 1].uri;
+            return true;
+         }
+      }
+      return false;
+   }
+
+   void Write(view_t text)
+   {
+      sink_->Write(text.data(), text.size());
+   }
+   // C14N escapes '>' in text, '"' and whitespace other than spaces in attribute values, and '\r' in both
+   void WriteEscaped(view_t text, bool attribute)
+   {
+      const TChar *pbegin = text.data();
+      const TChar *pend   = pbegin + text.size();
+      for (const TChar *pit = pbegin; pit != pend; ++pit) {
+         view_t replacement;
+         switch (*pit) {
+         case (TChar)'&': replacement = Replacement(0); break;
+         case (TChar)'<': replacement = Replacement(1); break;
+         case (TChar)'>': replacement = attribute ? view_t() : Replacement(2); break;
+         case (TChar)'"': replacement = attribute ? Replacement(3) : view_t(); break;
+         case (TChar)'\t': replacement = attribute ? Replacement(4) : view_t(); break;
+         case (TChar)'\n': replacement = attribute ? Replacement(5) : view_t(); break;
+         case (TChar)'\r': replacement = Replacement(6); break;
+         default: break;
+         }
+         if (!replacement.empty()) {
+            sink_->Write(pbegin, pit - pbegin);
+            Write(replacement);
+            pbegin = pit + 1;
+         }
+      }
+      sink_->Write(pbegin, pend - pbegin);
+   }
+   static view_t Replacement(int index) noexcept
+   {
+      static const TChar table[][7] = {{'&', 'a', 'm', 'p', ';'}, {'&', 'l', 't', ';'},
+                                       {'&', 'g', 't', ';'},      {'&', 'q', 'u', 'o', 't', ';'},
+                                       {'&', '#', 'x', '9', ';'}, {'&', '#', 'x', 'A', ';'},
+                                       {'&', '#', 'x', 'D', ';'}};
+      return view_t(table[index]);
+   }
+
+   TSink *sink_;
+   std::vector<Namespace> scope_; // declarations written by the open elements, innermost last
+   std::vector<const typename AttrMap<TChar>::value_type *> attrs_; // of the current element, except xmlns
+   std::vector<AttrKey> keys_;
+};
+
+// Copies version, encoding and standalone from the xml declaration in 'prolog', if any
+template <typename TChar>
+void ExtractDeclaration(const Prolog<TChar> &prolog, std::basic_string<TChar> *pversion,
+                        std::basic_string<TChar> *pencoding, std::basic_string<TChar> *pstandalone)
+{
+   if (!prolog.decl_begin)
+      return;
+   Interner<TChar> interner{ParseOptions()};
+   bool escape      = false;
+   auto declaration = ExtractAttributes<TChar>(prolog.decl_begin, prolog.decl_end, &interner, nullptr, &escape);
+
+   const std::basic_string<TChar> *decl_attrs = DeclarationAttrs<TChar>();
+   std::basic_string<TChar> *decl_data[]      = {pversion, pencoding, pstandalone};
+
+   for (int i = 0; i < 3; ++i) {
+      auto it = declaration.find(std::basic_string_view<TChar>(decl_attrs[i]));
+      if (it != declaration.cend()) {
+         *(decl_data[i]) = it->second.Get();
+      }
+   }
+}
+
+// Builds the element tree from tokens, see Tokenize(), passed one at a time in document order. The first token
+// is the start tag of the root element.
+template <typename TChar>
+class TreeBuilder
+{
+public:
+   // 'entities' must outlive the builder. Elements get their source spans with 'keep_source', which must only
+   // be set if the text outlives the tree, see ParseOptions::keep_source.
+   TreeBuilder(const ParseOptions &options, const EntityTable<TChar> &entities, bool keep_source)
+       : interner_(options), decoder_(entities, options),
+         pdecoder_(options.entity_references ? &decoder_ : nullptr), keep_source_(keep_source)
+   {}
+   TreeBuilder(const TreeBuilder &) = delete;
+   TreeBuilder &operator=(const TreeBuilder &) = delete;
+
+   // Sets up the root from its start tag and pushes it on the stack
+   void AddRoot(const TChar *pbegin, const TChar *pend)
+   {
+      root_                 = std::make_unique<ElementData<TChar>>();
+      root_->escape_content = false;
+      root_->escape_attrs   = false;
+      root_->name           = interner_.MakeName(ExtractName(pbegin, pend));
+      root_->attrs          = ExtractAttributes(pbegin, pend, &interner_, pdecoder_, &root_->escape_attrs);
+      if (keep_source_)
+         root_->source_begin = pbegin;
+      tree_.push(root_.get());
+   }
+   // Adds the token [pbegin, pend) to the element on top of the stack. Returns false if it's malformed.
+   bool AddToken(const TChar *pbegin, const TChar *pend)
+   {
+      int what = DetermineToken(pbegin, pend);
+
+      if (what & Token::OPEN) {
+         // Create and anchor a new element
+         ElementData<TChar> *pelem = new ElementData<TChar>();
+         tree_.top()->children.emplace_back(pelem); // creates std::unique_ptr implicitly
+         pelem->parent = tree_.top();
+
+         pelem->escape_content = false;
+         pelem->escape_attrs   = false;
+         pelem->name           = interner_.MakeName(ExtractName(pbegin, pend));
+         pelem->attrs          = ExtractAttributes(pbegin, pend, &interner_, pdecoder_, &pelem->escape_attrs);
+         if (keep_source_)
+            pelem->source_begin = pbegin;
+
+         tree_.push(pelem);
+      }
+      if (what & Token::CLOSE) {
+         // Elements are verbatim once their source is complete
+         const TChar *ptag_end = keep_source_ ? FindTagEnd(pbegin + 1, pend) : pend;
+         if (ptag_end != pend) {
+            tree_.top()->source_end = ptag_end + 1;
+            tree_.top()->verbatim   = true;
+         }
+         tree_.pop();
+         return true;
+      }
+      if (what == Token::CONTENT) {
+         // Only the new span is decoded and checked, text appended earlier has already been processed
+         ElementData<TChar> *pelem = tree_.top();
+         std::size_t old_size      = pelem->content.size();
+         if (pdecoder_)
+            pdecoder_->Append(&pelem->content, pbegin, pend);
+         else
+            pelem->content.append(pbegin, pend);
+         if (!pelem->escape_content)
+            pelem->escape_content = NeedsEscaping(std::basic_string_view<TChar>(pelem->content).substr(old_size));
+         return true;
+      }
+      // Comments are skipped
+      return what != Token::ERROR;
+   }
+   // Whether the root has been closed, so that the rest of the text is to be ignored
+   bool Complete() const noexcept
+   {
+      return root_ && tree_.empty();
+   }
+   std::unique_ptr<ElementData<TChar>> Release() noexcept
+   {
+      return std::move(root_);
+   }
+
+private:
+   Interner<TChar> interner_;
+   EntityDecoder<TChar> decoder_;
+   EntityDecoder<TChar> *pdecoder_;
+   // Copying the source would keep references to entities that the output doesn't declare
+   bool keep_source_;
+   std::unique_ptr<ElementData<TChar>> root_;
+   std::stack<ElementData<TChar> *, std::list<ElementData<TChar> *>> tree_; // open elements
+};
+
+// Builds the element tree and returns pointer to its root. Tokens of the prolog must be removed from
+// 'tokens' prior to calling this function. Ignores the rest after the root element has been closed.
+template <typename TChar>
+std::unique_ptr<ElementData<TChar>> BuildElementTree(const std::list<const TChar *> &tokens,
+                                                     const ParseOptions &options, const EntityTable<TChar> &entities)
+{
+   TreeBuilder<TChar> builder(options, entities, options.keep_source && entities.Empty());
+
+   auto it_right = tokens.begin();
+   auto it_left  = it_right++;
+   builder.AddRoot(*it_left, *it_right);
+
+   ++it_right;
+   ++it_left;
 
    // Last pointer in 'tokens' points to \0 so checking it_right instead of it_left
-   for (; it_right != tokens.cend() && tree.size() > 0; ++it_right, ++it_left) {
-      const TChar *pbegin = *it_left;
-      const TChar *pend   = *it_right;
+   for (; it_right != tokens.cend() && !builder.Complete(); ++it_right, ++it_left) {
+      if (!builder.AddToken(*it_left, *it_right))
+         return nullptr;
+   }
+   return builder.Release();
+}
+
+// Binary snapshot of a document, an image that is used in place without deserialization. All offsets are
+// relative to the beginning of the image and all fields have native byte order. Layout:
+//    SnapshotHeader
+//    SnapshotNode[node_count]   elements in breadth-first order, so children of each element are adjacent
+//    SnapshotAttr[attr_count]   attributes of each element are adjacent and sorted by name
+//    TChar[]                    string pool, names are stored once
+constexpr char SNAPSHOT_MAGIC[8]         = {'X', 'M', 'L', 'S', 'N', 'A', 'P', '\0'};
+constexpr std::uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotString
+{
+   std::uint32_t offset; // in symbols from the beginning of the string pool
+   std::uint32_t length;
+};
+
+struct SnapshotNode
+{
+   SnapshotString name;
+   SnapshotString content;
+   std::uint32_t first_attr;
+   std::uint32_t attr_count;
+   std::uint32_t first_child;
+   std::uint32_t child_count;
+};
+
+struct SnapshotAttr
+{
+   SnapshotString name;
+   SnapshotString value;
+};
+
+struct SnapshotHeader
+{
+   char magic[8];
+   std::uint32_t version;
+   std::uint32_t char_size;
+   std::uint64_t size;     // of the whole image in bytes
+   std::uint64_t checksum; // of everything after the header
+   std::uint64_t nodes;
+   std::uint64_t attrs;
+   std::uint64_t strings;
+   std::uint32_t node_count;
+   std::uint32_t attr_count;
+   SnapshotString declaration[3]; // version, encoding, standalone
+};
+
+static_assert(sizeof(SnapshotHeader) % 8 == 0 && sizeof(SnapshotNode) % 8 == 0 && sizeof(SnapshotAttr) % 8 == 0,
+              "Snapshot tables must stay 8-byte aligned");
+
+// Reads 8 bytes at a time, 'size' must be a multiple of 8
+inline std::uint64_t SnapshotChecksum(const char *pdata, std::size_t size) noexcept
+{
+   std::uint64_t hash = 0xcbf29ce484222325ULL;
+   for (const char *pend = pdata + size; pdata != pend; pdata += 8) {
+      std::uint64_t word;
+      std::memcpy(&word, pdata, 8);
+      hash = (hash ^ word) * 0x100000001b3ULL;
+      hash ^= hash >> 29;
+   }
+   return hash;
+}
+
+template <typename TChar>
+class SnapshotBuilder
+{
+public:
+   typedef std::basic_string_view<TChar> view_t;
+
+   // Returns the image
+   std::string Build(const ElementData<TChar> &root, const std::basic_string<TChar> *declaration[3])
+   {
+      // Breadth-first order makes the children of each element adjacent
+      std::vector<const ElementData<TChar> *> order{&root};
+      std::vector<SnapshotNode> nodes;
+      std::vector<SnapshotAttr> attrs;
+      for (std::size_t i = 0; i < order.size(); ++i) {
+         const ElementData<TChar> &e = *order[i];
+
+         SnapshotNode node;
+         node.name        = AddName(e.name);
+         node.content     = AddString(e.content);
+         node.first_attr  = Checked(attrs.size());
+         node.attr_count  = Checked(e.attrs.size());
+         node.first_child = Checked(order.size());
+         node.child_count = Checked(e.children.size());
+         nodes.push_back(node);
+
+         for (const auto &attr : e.attrs)
+            attrs.push_back({AddName(attr.first), AddString(attr.second)});
+         for (const auto &pchild : e.children)
+            order.push_back(pchild.get());
+      }
+
+      SnapshotHeader header = {};
+      std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+      header.version    = SNAPSHOT_VERSION;
+      header.char_size  = sizeof(TChar);
+      header.node_count = Checked(nodes.size());
+      header.attr_count = Checked(attrs.size());
+      for (int i = 0; i < 3; ++i)
+         header.declaration[i] = AddString(*declaration[i]);
+      header.nodes   = sizeof(header);
+      header.attrs   = header.nodes + nodes.size() * sizeof(SnapshotNode);
+      header.strings = header.attrs + attrs.size() * sizeof(SnapshotAttr);
+      header.size    = (header.strings + pool_.size() * sizeof(TChar) + 7) / 8 * 8;
+
+      std::string image(header.size, '\0');
+      std::memcpy(&image[header.nodes], nodes.data(), nodes.size() * sizeof(SnapshotNode));
+      std::memcpy(&image[header.attrs], attrs.data(), attrs.size() * sizeof(SnapshotAttr));
+      std::memcpy(&image[header.strings], pool_.data(), pool_.size() * sizeof(TChar));
+      header.checksum = SnapshotChecksum(&image[sizeof(header)], image.size() - sizeof(header));
+      std::memcpy(&image[0], &header, sizeof(header));
+      return image;
+   }
+
+private:
+   static std::uint32_t Checked(std::size_t value)
+   {
+      if (value > UINT32_MAX)
+         throw Exception("Document is too large for a snapshot");
+      return static_cast<std::uint32_t>(value);
+   }
+   SnapshotString AddString(view_t text)
+   {
+      SnapshotString ref = {Checked(pool_.size()), Checked(text.size())};
+      pool_.append(text);
+      Checked(pool_.size());
+      return ref;
+   }
+   // Names repeat a lot, so each one is stored once
+   SnapshotString AddName(view_t name)
+   {
+      auto it = names_.find(name);
+      if (it != names_.end())
+         return it->second;
+      SnapshotString ref = AddString(name);
+      names_.emplace(view_t(name), ref);
+      return ref;
+   }
+
+   std::basic_string<TChar> pool_;
+   std::unordered_map<view_t, SnapshotString> names_; // views into the document, which outlives the builder
+};
 
-      int what = DetermineToken(pbegin, pend);
+// Compact binary encoding of documents for transport between programs using this library. Names, attribute
+// values and content are replaced by indices into tables that are built on the fly: the first occurrence of a
+// string is written in full and gets the next index. Strings are written as their length followed by the
+// symbols, without escaping. Integers are LEB128 varints, wide symbols are varints too, so the encoding doesn't
+// depend on byte order. Layout:
+//    'X' 'B' version sizeof(TChar)
+//    version, encoding and standalone strings of the declaration
+//    root element
+// where an element is
+//    name, attribute count, {name, value}*, value of the content, child element*, 0
+// a name is 1 followed by the string for a new name or index + 2 for a known one, and a value is the same as a
+// name except that 0 followed by the string stands for a value that isn't added to the table.
+constexpr unsigned char BINARY_VERSION = 1;
 
-      if (what & Token::OPEN) {
-         // Create and anchor a new element
-         ElementData<TChar> *pelem = new ElementData<TChar>();
-         tree.top()->children.emplace_back(pelem); // creates std::unique_ptr implicitly
+// Values up to this length are added to the table of values. Longer ones rarely repeat.
+constexpr std::size_t BINARY_MAX_TABLE_VALUE = 32;
+
+template <typename TChar>
+class BinaryEncoder
+{
+public:
+   typedef std::basic_string_view<TChar> view_t;
 
-         pelem->name  = ExtractName(pbegin, pend);
-         pelem->attrs = ExtractAttributes(pbegin, pend);
+   void Encode(const ElementData<TChar> &root, const std::basic_string<TChar> *declaration[3], std::string *out)
+   {
+      out_ = out;
+      out_->push_back('X');
+      out_->push_back('B');
+      out_->push_back(static_cast<char>(BINARY_VERSION));
+      out_->push_back(static_cast<char>(sizeof(TChar)));
+      for (int i = 0; i < 3; ++i)
+         WriteString(*declaration[i]);
+      WriteElement(root);
+   }
 
-         tree.push(pelem);
+private:
+   void WriteElement(const ElementData<TChar> &root)
+   {
+      auto enter = [this](const ElementData<TChar> &e) {
+         WriteName(e.name);
+         WriteVarint(e.attrs.size());
+         for (const auto &attr : e.attrs) {
+            WriteName(attr.first);
+            WriteValue(attr.second);
+         }
+         WriteValue(e.content);
+         return true;
+      };
+      VisitTree(root, enter, [this](const ElementData<TChar> &) { WriteVarint(0); });
+   }
+   void WriteName(view_t name)
+   {
+      WriteIndexed(&names_, name);
+   }
+   void WriteValue(view_t value)
+   {
+      if (value.size() > BINARY_MAX_TABLE_VALUE) {
+         WriteVarint(0);
+         WriteString(value);
+         return;
       }
-      if (what & Token::CLOSE) {
-         tree.pop();
-         continue;
+      WriteIndexed(&values_, value);
+   }
+   void WriteIndexed(std::unordered_map<view_t, std::size_t> *ptable, view_t text)
+   {
+      auto result = ptable->emplace(text, ptable->size());
+      if (result.second) {
+         WriteVarint(1);
+         WriteString(text);
       }
-      if (what == Token::CONTENT) {
-         tree.top()->content.append(pbegin, pend);
-         if (replace_er) {
-            SubstituteEntityRef(&tree.top()->content);
+      else {
+         WriteVarint(result.first->second + 2);
+      }
+   }
+   void WriteString(view_t text)
+   {
+      WriteVarint(text.size());
+      if constexpr (sizeof(TChar) == 1) {
+         out_->append(reinterpret_cast<const char *>(text.data()), text.size());
+      }
+      else {
+         for (TChar symbol : text)
+            WriteVarint(static_cast<std::make_unsigned_t<TChar>>(symbol));
+      }
+   }
+   void WriteVarint(std::uint64_t value)
+   {
+      for (; value >= 0x80; value >>= 7)
+         out_->push_back(static_cast<char>(value | 0x80));
+      out_->push_back(static_cast<char>(value));
+   }
+
+   std::string *out_ = nullptr;
+   // Views into the document being encoded
+   std::unordered_map<view_t, std::size_t> names_;
+   std::unordered_map<view_t, std::size_t> values_;
+};
+
+// Decodes the output of BinaryEncoder. Throws xml::Exception if the data is malformed or truncated.
+template <typename TChar>
+class BinaryDecoder
+{
+public:
+   typedef std::basic_string<TChar> string_t;
+
+   BinaryDecoder(const char *data, std::size_t size)
+       : pos_(reinterpret_cast<const unsigned char *>(data)), end_(pos_ + size)
+   {}
+
+   std::unique_ptr<ElementData<TChar>> Decode(string_t declaration[3])
+   {
+      if (end_ - pos_ < 4 || pos_[0] != 'X' || pos_[1] != 'B')
+         throw Exception("Not a binary xml document");
+      if (pos_[2] != BINARY_VERSION || pos_[3] != sizeof(TChar))
+         throw Exception("Unsupported binary xml version");
+      pos_ += 4;
+      for (int i = 0; i < 3; ++i)
+         ReadString(&declaration[i]);
+
+      // Iterative, so that deep nesting in the input cannot exhaust the stack
+      auto root = std::make_unique<ElementData<TChar>>();
+      ReadElement(root.get(), ReadVarint());
+      std::vector<ElementData<TChar> *> open{root.get()};
+      while (!open.empty()) {
+         std::uint64_t name = ReadVarint();
+         if (name == 0) {
+            open.pop_back();
+            continue;
          }
-         continue;
+         ElementData<TChar> *pelem = new ElementData<TChar>();
+         open.back()->children.emplace_back(pelem);
+         pelem->parent = open.back();
+         ReadElement(pelem, name);
+         open.push_back(pelem);
       }
-      if (what == Token::ERROR) {
-         return nullptr;
+      if (pos_ != end_)
+         throw Exception("Malformed binary xml document");
+      return root;
+   }
+
+private:
+   // Reads everything but the children
+   void ReadElement(ElementData<TChar> *pelem, std::uint64_t name)
+   {
+      pelem->name         = ReadIndexed(&names_, name);
+      pelem->escape_attrs = false;
+      for (std::uint64_t count = ReadVarint(); count > 0; --count) {
+         const string_t &attr_name = ReadIndexed(&names_, ReadVarint());
+         string_t value;
+         ReadValue(&value);
+         if (!pelem->escape_attrs)
+            pelem->escape_attrs = NeedsEscaping<TChar>(value);
+         pelem->attrs.emplace(SharedString<TChar>(attr_name), std::move(value));
+      }
+      ReadValue(&pelem->content);
+      pelem->escape_content = NeedsEscaping<TChar>(pelem->content);
+   }
+   void ReadValue(string_t *out)
+   {
+      std::uint64_t index = ReadVarint();
+      if (index == 0)
+         ReadString(out);
+      else
+         *out = ReadIndexed(&values_, index);
+   }
+   const string_t &ReadIndexed(std::deque<string_t> *ptable, std::uint64_t index)
+   {
+      if (index == 1) {
+         ptable->emplace_back();
+         ReadString(&ptable->back());
+         return ptable->back();
+      }
+      if (index < 2 || index - 2 >= ptable->size())
+         throw Exception("Malformed binary xml document");
+      return (*ptable)[index - 2];
+   }
+   void ReadString(string_t *out)
+   {
+      std::uint64_t size = ReadVarint();
+      if (size > static_cast<std::uint64_t>(end_ - pos_))
+         throw Exception("Malformed binary xml document");
+      if constexpr (sizeof(TChar) == 1) {
+         out->assign(reinterpret_cast<const TChar *>(pos_), size);
+         pos_ += size;
+      }
+      else {
+         out->resize(size);
+         for (TChar &symbol : *out)
+            symbol = static_cast<TChar>(ReadVarint());
+      }
+   }
+   std::uint64_t ReadVarint()
+   {
+      std::uint64_t value = 0;
+      for (int shift = 0; shift < 64; shift += 7) {
+         if (pos_ == end_)
+            break;
+         unsigned char byte = *pos_++;
+         value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+         if (!(byte & 0x80))
+            return value;
       }
-      // if (what == Token::COMMENT) continue;
+      throw Exception("Malformed binary xml document");
+   }
+
+   const unsigned char *pos_;
+   const unsigned char *end_;
+   // Deques keep references valid while growing
+   std::deque<string_t> names_;
+   std::deque<string_t> values_;
+};
+
+// Number of symbols from the current position to the end of 'stream', or 0 if it isn't seekable. For streams
+// that convert an external encoding it's the external length, which is usually an upper bound.
+template <typename TChar>
+std::size_t RemainingSize(std::basic_istream<TChar> &stream)
+{
+   const typename std::basic_istream<TChar>::pos_type unknown(-1);
+   const auto start = stream.tellg();
+   if (start == unknown)
+      return 0;
+   const auto end = stream.seekg(0, std::ios::end).tellg();
+   stream.clear();
+   stream.seekg(start);
+   return end != unknown && end > start ? static_cast<std::size_t>(end - start) : 0;
+}
+
+// Reads the rest of 'stream' into a null-terminated buffer. Seekable streams are read at once into a buffer of
+// their remaining size. Others are read into a chain of blocks of growing size, which are copied into one buffer
+// when the total is known, so that nothing is reallocated.
+template <typename TChar>
+std::unique_ptr<TChar[]> ReadStream(std::basic_istream<TChar> &stream)
+{
+   typedef typename std::basic_istream<TChar>::traits_type traits_t;
+   constexpr std::size_t FIRST_BLOCK = 1 << 16;
+   constexpr std::size_t MAX_BLOCK   = 1 << 24;
+
+   std::vector<std::pair<std::unique_ptr<TChar[]>, std::size_t>> blocks; // data and length, room for '\0' each
+   std::size_t total = 0;
+   std::size_t hint  = RemainingSize(stream);
+   for (std::size_t block_size = hint ? hint + 1 : FIRST_BLOCK;; block_size = std::min(2 * block_size, MAX_BLOCK)) {
+      std::unique_ptr<TChar[]> block(new TChar[block_size]);
+      stream.read(block.get(), static_cast<std::streamsize>(block_size - 1));
+      std::size_t length = static_cast<std::size_t>(stream.gcount());
+      total += length;
+      blocks.emplace_back(std::move(block), length);
+      if (!stream || traits_t::eq_int_type(stream.peek(), traits_t::eof()))
+         break;
    }
-   return root;
+   if (blocks.size() == 1) {
+      blocks[0].first[total] = 0;
+      return std::move(blocks[0].first);
+   }
+   std::unique_ptr<TChar[]> text(new TChar[total + 1]);
+   TChar *pdest = text.get();
+   for (const auto &block : blocks) {
+      std::char_traits<TChar>::copy(pdest, block.first.get(), block.second);
+      pdest += block.second;
+   }
+   *pdest = 0;
+   return text;
 }
 
+// Whole file in memory followed by at least one zero byte, so that the text is null-terminated. Regular files
+// are mapped read-only with a hint for sequential reading. The file mustn't be truncated while it's mapped.
+// Other systems read it into a buffer.
+class MappedFile
+{
+public:
+   MappedFile() = default;
+   // Throws xml::Exception if the file cannot be read
+   explicit MappedFile(const std::string &path)
+   {
+#ifdef XMLPARSER_POSIX
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+         throw Exception("Failed to open " + path);
+      struct stat info;
+      if (::fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+         ::close(fd);
+         throw Exception("Not a regular file " + path);
+      }
+      size_ = static_cast<std::size_t>(info.st_size);
+      // The file is mapped over anonymous memory that is longer by at least one byte. The tail of the last page
+      // of a mapped file reads as zeroes too, but a file may end exactly at a page boundary.
+      const std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+      length_                = (size_ / page + 1) * page;
+      void *paddr            = ::mmap(nullptr, length_, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (paddr != MAP_FAILED && size_ > 0 &&
+          ::mmap(paddr, size_, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+         ::munmap(paddr, length_);
+         paddr = MAP_FAILED;
+      }
+      ::close(fd);
+      if (paddr == MAP_FAILED)
+         throw Exception("Failed to map " + path);
+      if (size_ > 0)
+         ::madvise(paddr, size_, MADV_SEQUENTIAL);
+      ptext_ = static_cast<const char *>(paddr);
+#else
+      std::ifstream file(path, std::ios::binary | std::ios::ate);
+      if (!file)
+         throw Exception("Failed to open " + path);
+      size_ = static_cast<std::size_t>(file.tellg());
+      buffer_.reset(new char[size_ + 1]);
+      buffer_[size_] = '\0';
+      file.seekg(0);
+      if (!file.read(buffer_.get(), static_cast<std::streamsize>(size_)))
+         throw Exception("Failed to read " + path);
+      ptext_ = buffer_.get();
+#endif
+   }
+   ~MappedFile()
+   {
+      Reset();
+   }
+   MappedFile(MappedFile &&other) noexcept
+   {
+      Swap(other);
+   }
+   MappedFile &operator=(MappedFile &&other) noexcept
+   {
+      Swap(other);
+      return *this;
+   }
+
+   // Contents of the file followed by '\0'
+   const char *Text() const noexcept
+   {
+      return ptext_;
+   }
+   // Length of the file
+   std::size_t Size() const noexcept
+   {
+      return size_;
+   }
+   // Releases the memory
+   void Reset() noexcept
+   {
+#ifdef XMLPARSER_POSIX
+      if (ptext_)
+         ::munmap(const_cast<char *>(ptext_), length_);
+      length_ = 0;
+#else
+      buffer_.reset();
+#endif
+      ptext_ = nullptr;
+      size_  = 0;
+   }
+
+private:
+   void Swap(MappedFile &other) noexcept
+   {
+      std::swap(ptext_, other.ptext_);
+      std::swap(size_, other.size_);
+#ifdef XMLPARSER_POSIX
+      std::swap(length_, other.length_);
+#else
+      std::swap(buffer_, other.buffer_);
+#endif
+   }
+
+   const char *ptext_ = nullptr;
+   std::size_t size_  = 0;
+#ifdef XMLPARSER_POSIX
+   std::size_t length_ = 0; // of the mapping
+#else
+   std::unique_ptr<char[]> buffer_;
+#endif
+};
+
 } // namespace details
 
+// Sinks receive the output of serialization. Any class with a member function
+//    void Write(const TChar *data, std::size_t size);
+// can be used as a sink. A sink may also provide
+//    void WriteStable(const TChar *data, std::size_t size);
+// which the serializer calls instead of Write(). The data passed to it stays valid until the sink is flushed.
 
-class Exception : std::logic_error
+// Appends output to a std::basic_string. Writes go directly into the string's buffer, which is grown
+// geometrically and trimmed to the written length by Finish() or the destructor.
+template <typename TChar>
+class StringSink
 {
 public:
-   Exception(const char *what) : std::logic_error(what)
+   explicit StringSink(std::basic_string<TChar> *out) : out_(out), data_(&(*out)[0]), size_(out->size())
    {}
-   Exception(const std::string &what) : std::logic_error(what)
+   ~StringSink()
+   {
+      Finish();
+   }
+   StringSink(const StringSink &) = delete;
+   StringSink &operator=(const StringSink &) = delete;
+
+   void Write(const TChar *data, std::size_t size)
+   {
+      if (out_->size() - size_ < size)
+         Grow(size);
+      std::char_traits<TChar>::copy(data_ + size_, data, size);
+      size_ += size;
+   }
+   // Trims the string to the data written so far
+   void Finish()
+   {
+      out_->resize(size_);
+   }
+
+private:
+   void Grow(std::size_t size)
+   {
+      // Use up the existing capacity before reallocating
+      out_->resize(std::max({size_ + size, out_->capacity(), 2 * out_->size()}));
+      data_ = &(*out_)[0];
+   }
+
+   std::basic_string<TChar> *out_;
+   TChar *data_;
+   std::size_t size_; // written length, the string itself is usually longer until Finish()
+};
+
+// Writes output to a std::basic_ostream through a fixed-size buffer, so that the stream is called once per
+// buffer rather than once per fragment. Errors are reported by the stream state.
+template <typename TChar, std::size_t BUFFER_SIZE = 4096>
+class OStreamSink
+{
+public:
+   explicit OStreamSink(std::basic_ostream<TChar> *out) : out_(out), used_(0)
    {}
-   virtual const char *what() const noexcept
+   ~OStreamSink()
    {
-      return std::logic_error::what();
+      Flush();
+   }
+   OStreamSink(const OStreamSink &) = delete;
+   OStreamSink &operator=(const OStreamSink &) = delete;
+
+   void Write(const TChar *data, std::size_t size)
+   {
+      if (BUFFER_SIZE - used_ < size) {
+         Flush();
+         if (size >= BUFFER_SIZE) {
+            out_->write(data, static_cast<std::streamsize>(size));
+            return;
+         }
+      }
+      std::char_traits<TChar>::copy(buffer_ + used_, data, size);
+      used_ += size;
+   }
+   void Flush()
+   {
+      if (used_ > 0)
+         out_->write(buffer_, static_cast<std::streamsize>(used_));
+      used_ = 0;
+   }
+
+private:
+   std::basic_ostream<TChar> *out_;
+   std::size_t used_;
+   TChar buffer_[BUFFER_SIZE];
+};
+
+#ifdef XMLPARSER_POSIX
+
+// Writes output to a file descriptor with writev(). Small fragments are copied into a fixed-size buffer, large
+// stable fragments are handed to the kernel as they are. Code units are written as they are, i.e. wide
+// characters are not converted. Throws xml::Exception if writing fails.
+template <typename TChar, std::size_t BUFFER_SIZE = 16384>
+class FdSink
+{
+public:
+   explicit FdSink(int fd) : fd_(fd), used_(0), count_(0)
+   {}
+   ~FdSink()
+   {
+      try {
+         Flush();
+      }
+      catch (const Exception &) {
+      }
+   }
+   FdSink(const FdSink &) = delete;
+   FdSink &operator=(const FdSink &) = delete;
+
+   void Write(const TChar *data, std::size_t size)
+   {
+      if (count_ == MAX_SEGMENTS || BUFFER_SIZE - used_ < size)
+         Flush();
+      if (size >= BUFFER_SIZE) {
+         AddSegment(data, size);
+         Flush();
+         return;
+      }
+      std::char_traits<TChar>::copy(buffer_ + used_, data, size);
+      AddSegment(buffer_ + used_, size);
+      used_ += size;
+   }
+   // 'data' must stay valid until Flush()
+   void WriteStable(const TChar *data, std::size_t size)
+   {
+      if (size < MIN_DIRECT_SIZE) {
+         Write(data, size);
+         return;
+      }
+      if (count_ == MAX_SEGMENTS)
+         Flush();
+      AddSegment(data, size);
+   }
+   void Flush()
+   {
+      iovec *piov = iov_;
+      int count   = static_cast<int>(count_);
+      count_      = 0;
+      used_       = 0;
+      while (count > 0) {
+         ssize_t written = ::writev(fd_, piov, count);
+         if (written < 0) {
+            if (errno == EINTR)
+               continue;
+            throw Exception("Failed to write to file descriptor");
+         }
+         // Skip the segments written completely, then the written part of the next one
+         for (; count > 0 && static_cast<std::size_t>(written) >= piov->iov_len; ++piov, --count)
+            written -= piov->iov_len;
+         if (count > 0) {
+            piov->iov_base = static_cast<char *>(piov->iov_base) + written;
+            piov->iov_len -= written;
+         }
+      }
+   }
+
+private:
+   static constexpr std::size_t MAX_SEGMENTS    = 64;  // well below IOV_MAX on common systems
+   static constexpr std::size_t MIN_DIRECT_SIZE = 256; // copying is cheaper than a segment for shorter data
+
+   void AddSegment(const TChar *data, std::size_t size)
+   {
+      if (size == 0)
+         return;
+      std::size_t bytes = size * sizeof(TChar);
+      // Consecutive buffered fragments are merged into one segment
+      if (count_ > 0 && static_cast<const char *>(iov_[count_ - 1].iov_base) + iov_[count_ - 1].iov_len ==
+                            reinterpret_cast<const char *>(data)) {
+         iov_[count_ - 1].iov_len += bytes;
+         return;
+      }
+      iov_[count_].iov_base = const_cast<TChar *>(data);
+      iov_[count_].iov_len  = bytes;
+      ++count_;
+   }
+
+   int fd_;
+   std::size_t used_;
+   std::size_t count_;
+   iovec iov_[MAX_SEGMENTS];
+   TChar buffer_[BUFFER_SIZE];
+};
+
+#endif // XMLPARSER_POSIX
+
+// Writes xml directly to a sink without building a tree. Elements are opened and closed explicitly, attributes
+// and text are escaped as needed:
+//    writer.StartElement("item");
+//    writer.Attribute("id", "1");
+//    writer.Text("a < b");
+//    writer.EndElement();
+// Throws xml::Exception if the calls don't form a well-nested document with a single root.
+template <typename TChar, typename TSink = StringSink<TChar>>
+class Writer
+{
+public:
+   typedef std::basic_string<TChar> string_t;
+   typedef std::basic_string_view<TChar> view_t;
+
+   explicit Writer(TSink *sink) : sink_(sink), tag_open_(false), root_written_(false)
+   {}
+   Writer(const Writer &) = delete;
+   Writer &operator=(const Writer &) = delete;
+
+   // Must precede the root element. Empty values are omitted.
+   void Declaration(view_t version, view_t encoding = view_t(), view_t standalone = view_t())
+   {
+      if (root_written_ || !open_.empty())
+         throw Exception("Declaration must precede the root element");
+
+      using details::Markup;
+      const string_t *decl_attrs = details::DeclarationAttrs<TChar>();
+      const view_t decl_data[]   = {version, encoding, standalone};
+      Write(Markup::DECL_START);
+      for (int i = 0; i < 3; ++i) {
+         if (!decl_data[i].empty()) {
+            Write(Markup::ATTR_START);
+            Write(decl_attrs[i]);
+            Write(Markup::ATTR_MID);
+            Write(decl_data[i]);
+            Write(Markup::ATTR_END);
+         }
+      }
+      Write(Markup::DECL_END);
+   }
+   void StartElement(view_t name)
+   {
+      if (name.empty())
+         throw Exception("Element name is empty");
+      if (open_.empty() && root_written_)
+         throw Exception("Document already has a root element");
+
+      CloseStartTag();
+      Write(details::Markup::OPENING_TAG_START);
+      Write(name);
+      open_.push_back(names_.size());
+      names_.append(name);
+      tag_open_ = true;
+   }
+   // Adds an attribute to the element started last, must precede its text and children
+   void Attribute(view_t name, view_t value)
+   {
+      if (!tag_open_)
+         throw Exception("Attribute " + details::Narrow(name) + " must follow start of an element");
+
+      Write(details::Markup::ATTR_START);
+      Write(name);
+      Write(details::Markup::ATTR_MID);
+      WriteEscaped(value);
+      Write(details::Markup::ATTR_END);
+   }
+   void Text(view_t text)
+   {
+      if (open_.empty())
+         throw Exception("Text must be inside an element");
+
+      CloseStartTag();
+      WriteEscaped(text);
+   }
+   // Closes the element started last. Elements without text and children are written as <name />.
+   void EndElement()
+   {
+      if (open_.empty())
+         throw Exception("No element to end");
+
+      if (tag_open_) {
+         Write(details::Markup::SINGLE_TAG_END);
+         tag_open_ = false;
+      }
+      else {
+         Write(details::Markup::CLOSING_TAG_START);
+         Write(view_t(names_).substr(open_.back()));
+         Write(details::Markup::CLOSING_TAG_END);
+      }
+      names_.resize(open_.back());
+      open_.pop_back();
+      if (open_.empty())
+         root_written_ = true;
+   }
+
+   // Number of elements started and not yet ended
+   std::size_t Depth() const noexcept
+   {
+      return open_.size();
+   }
+
+private:
+   void CloseStartTag()
+   {
+      if (tag_open_) {
+         Write(details::Markup::OPENING_TAG_END);
+         tag_open_ = false;
+      }
+   }
+   void Write(view_t text)
+   {
+      sink_->Write(text.data(), text.size());
+   }
+   void Write(details::Markup markup)
+   {
+      Write(details::MarkupTable<TChar>(markup));
+   }
+   void WriteEscaped(view_t text)
+   {
+      details::WriteEscaped(text, [this](const TChar *data, std::size_t size) { sink_->Write(data, size); });
+   }
+
+   TSink *sink_;
+   string_t names_;                // names of the open elements, one after another
+   std::vector<std::size_t> open_; // start of each open element's name in 'names_'
+   bool tag_open_;                 // start tag of the last element lacks its closing '>'
+   bool root_written_;
+};
+
+// Converts the output to UTF-8 and passes it to another sink, 'TSink', which receives chars. Narrow output is
+// assumed to be UTF-8 already and is passed through. Wide output is converted in one pass through a fixed-size
+// buffer, see details::Utf8Encoder, e.g. to write a wchar_t document to a byte buffer:
+//    xml::StringSink<char> bytes(&out);
+//    xml::Utf8Sink<wchar_t, xml::StringSink<char>> sink(&bytes);
+//    doc.Serialize(sink);
+template <typename TChar, typename TSink, std::size_t BUFFER_SIZE = 4096>
+class Utf8Sink
+{
+public:
+   explicit Utf8Sink(TSink *sink) : sink_(sink), used_(0)
+   {}
+   ~Utf8Sink()
+   {
+      try {
+         Finish();
+      }
+      catch (const Exception &) {
+      }
+   }
+   Utf8Sink(const Utf8Sink &) = delete;
+   Utf8Sink &operator=(const Utf8Sink &) = delete;
+
+   void Write(const TChar *data, std::size_t size)
+   {
+      if constexpr (sizeof(TChar) == 1) {
+         sink_->Write(reinterpret_cast<const char *>(data), size);
+      }
+      else {
+         for (const TChar *pend = data + size; data != pend;) {
+            if (BUFFER_SIZE - used_ < encoder_t::MaxSize(MIN_CHUNK))
+               Flush();
+            // As many symbols as surely fit into the rest of the buffer
+            std::size_t room  = (BUFFER_SIZE - used_ - 3) / encoder_t::MAX_SYMBOL_SIZE;
+            std::size_t count = std::min<std::size_t>(pend - data, room);
+            used_             = encoder_.Encode(data, data + count, buffer_ + used_) - buffer_;
+            data += count;
+         }
+      }
    }
+   // Passes the converted output to 'TSink', which isn't flushed itself
+   void Flush()
+   {
+      if (used_ > 0)
+         sink_->Write(buffer_, used_);
+      used_ = 0;
+   }
+   // Same as Flush(), but first writes U+FFFD for a high surrogate that is still waiting for its pair
+   void Finish()
+   {
+      if constexpr (sizeof(TChar) != 1) {
+         if (BUFFER_SIZE - used_ < 3)
+            Flush();
+         used_ = encoder_.Finish(buffer_ + used_) - buffer_;
+      }
+      Flush();
+   }
+
+private:
+   typedef details::Utf8Encoder<TChar> encoder_t;
+
+   static constexpr std::size_t MIN_CHUNK = 64; // symbols converted at least per call of the encoder
+   static_assert(BUFFER_SIZE >= encoder_t::MaxSize(MIN_CHUNK), "Buffer too small");
+
+   TSink *sink_;
+   std::size_t used_;
+   encoder_t encoder_;
+   char buffer_[BUFFER_SIZE];
+};
+
+// Computes the SHA-256 digest of the output instead of storing it. Wide characters are hashed as UTF-8.
+template <typename TChar>
+class Sha256Sink
+{
+public:
+   Sha256Sink() : utf8_(&hash_)
+   {}
+
+   void Write(const TChar *data, std::size_t size)
+   {
+      utf8_.Write(data, size);
+   }
+   // Digest of everything written so far, after which the sink starts over
+   std::array<unsigned char, 32> Digest() noexcept
+   {
+      utf8_.Finish();
+      return hash_.Final();
+   }
+
+private:
+   details::Sha256 hash_;
+   Utf8Sink<TChar, details::Sha256> utf8_;
 };
 
+template <typename TChar>
+std::basic_ostream<TChar> &operator<<(std::basic_ostream<TChar> &out, const details::ElementData<TChar> &e)
+{
+   OStreamSink<TChar> sink(&out);
+   details::Serializer<TChar, OStreamSink<TChar>>(&sink).WriteElement(e);
+   return out;
+}
+
 // Thin wrapper containing pointer to a node in the element tree, and defining user interface
 // functions to access and modify data. Has no ownership of the underlying node.
 template <typename TChar>
@@ -530,35 +3398,49 @@ public:
 
    const std::basic_string<char_t> &GetName() const noexcept
    {
-      return pdata_->name;
+      return pdata_->name.Get();
    }
    // Set name that (optionally) includes namespace
    void SetName(std::basic_string<char_t> name)
    {
       pdata_->name = std::move(name);
+      pdata_->MarkTagModified();
    }
    // Set namespace and name
    void SetName(std::basic_string<char_t> ns, std::basic_string<char_t> name)
    {
       pdata_->name = std::move(ns) + ":" + std::move(name);
+      pdata_->MarkTagModified();
    }
    // Namespace name or empty.
    std::basic_string<char_t> GetNamePrefix() const
    {
-      size_t pos = pdata_->name.find_first_of((char_t)':');
-      if (pos != pdata_->name.npos) {
-         return pdata_->name.substr(0, pos);
-      }
-      return "";
+      return std::basic_string<char_t>(GetNamePrefixView());
    }
    // Returns copy of the whole name if no namespace prefix.
    std::basic_string<char_t> GetNamePostfix() const
    {
-      size_t pos = pdata_->name.find_first_of((char_t)':');
-      if (pos != pdata_->name.npos) {
-         return pdata_->name.substr(pos + 1);
+      return std::basic_string<char_t>(GetNamePostfixView());
+   }
+   // Same as GetNamePrefix(), but refers to the name stored in the element instead of copying it.
+   std::basic_string_view<char_t> GetNamePrefixView() const noexcept
+   {
+      std::basic_string_view<char_t> name = pdata_->name;
+      size_t pos                          = name.find((char_t)':');
+      if (pos != name.npos) {
+         return name.substr(0, pos);
+      }
+      return std::basic_string_view<char_t>();
+   }
+   // Same as GetNamePostfix(), but refers to the name stored in the element instead of copying it.
+   std::basic_string_view<char_t> GetNamePostfixView() const noexcept
+   {
+      std::basic_string_view<char_t> name = pdata_->name;
+      size_t pos                          = name.find((char_t)':');
+      if (pos != name.npos) {
+         return name.substr(pos + 1);
       }
-      return pdata_->name;
+      return name;
    }
 
    const std::basic_string<char_t> &GetContent() const noexcept
@@ -569,35 +3451,45 @@ public:
    {
       if (GetChildCount() != 0)
          throw Exception("Cannot have both content and children");
-      pdata_->content = std::move(content);
+      pdata_->escape_content = details::NeedsEscaping<char_t>(content);
+      pdata_->content        = std::move(content);
+      pdata_->MarkModified();
    }
 
-   const std::basic_string<char_t> &GetAttributeValue(const std::basic_string<char_t> &attribute) const
+   const std::basic_string<char_t> &GetAttributeValue(std::basic_string_view<char_t> attribute) const
    {
       auto it = pdata_->attrs.find(attribute);
       if (it == pdata_->attrs.cend()) {
-         throw Exception("Attribute " + attribute + " not found");
+         throw Exception("Attribute " + details::Narrow(attribute) + " not found");
       }
-      return it->second;
+      return it->second.Get();
    }
    const std::basic_string<char_t> &GetAttributeName(std::size_t index) const
    {
-      return GetAttr(index).first;
+      return GetAttr(index).first.Get();
    }
    const std::basic_string<char_t> &GetAttributeValue(std::size_t index) const
    {
-      return GetAttr(index).second;
+      return GetAttr(index).second.Get();
    }
    // Changes value of an existing attribute if 'name' is already in the list of attributes
    void AddAttribute(std::basic_string<char_t> name, std::basic_string<char_t> value)
    {
-      pdata_->attrs[std::move(name)] = std::move(value);
+      if (!pdata_->escape_attrs)
+         pdata_->escape_attrs = details::NeedsEscaping<char_t>(value);
+      pdata_->attrs[details::SharedString<char_t>(std::move(name))] = std::move(value);
+      pdata_->MarkTagModified();
    }
 
    std::size_t GetAttributeCount() const noexcept
    {
       return pdata_->attrs.size();
    }
+   // Length of the serialized element including its children, without producing the output
+   std::size_t SerializedSize() const
+   {
+      return details::SerializedSize(*pdata_);
+   }
    std::size_t GetChildCount() const noexcept
    {
       return pdata_->children.size();
@@ -613,7 +3505,7 @@ public:
       details::ElementData<char_t> *pnode = pdata_->children[index].get();
       return pnode;
    }
-   const my_t GetChild(const std::basic_string<char_t> &name) const
+   const my_t GetChild(std::basic_string_view<char_t> name) const
    {
       for (auto it = pdata_->children.cbegin(); it != pdata_->children.cend(); ++it) {
          details::ElementData<char_t> *pnode = it->get();
@@ -621,7 +3513,7 @@ public:
             return pnode;
          }
       }
-      throw Exception("Child " + name + " not found");
+      throw Exception("Child " + details::Narrow(name) + " not found");
    }
    // Create a new child at pos. If 'pos' is larger than current children count, inserts child at the end
    my_t AddChild(std::size_t pos, const char_t *name = nullptr)
@@ -637,8 +3529,10 @@ public:
       details::ElementData<char_t> *pchild = new details::ElementData<char_t>();
       if (name)
          pchild->name = name;
+      pchild->parent = pdata_;
 
       pdata_->children.insert(it, std::unique_ptr<details::ElementData<char_t>>(pchild));
+      pdata_->MarkModified();
       return pchild;
    }
    // Create new child at the end
@@ -650,15 +3544,65 @@ public:
       details::ElementData<char_t> *pchild = new details::ElementData<char_t>();
       if (name)
          pchild->name = name;
+      pchild->parent = pdata_;
 
       pdata_->children.emplace_back(pchild);
+      pdata_->MarkModified();
       return pchild;
    }
 
+   // Serialize the element and its children to xml. With 'namespaces', namespace declarations inherited from the
+   // ancestors are added to the element, so that the output can be parsed on its own.
+   std::basic_string<char_t> ToString(bool namespaces = false, const WriteOptions &options = WriteOptions()) const
+   {
+      std::basic_string<char_t> out;
+      ToString(out, namespaces, options);
+      return out;
+   }
+   // Same as ToString(), but replaces the content of 'out' and reuses its capacity
+   void ToString(std::basic_string<char_t> &out, bool namespaces = false,
+                 const WriteOptions &options = WriteOptions()) const
+   {
+      out.clear();
+      out.reserve(SerializedSize()); // exact unless pretty-printing or adding namespaces
+      StringSink<char_t> sink(&out);
+      Serialize(sink, namespaces, options);
+   }
+   // Serialize the element and its children to xml into any sink, see xml::StringSink
+   template <typename TSink>
+   void Serialize(TSink &sink, bool namespaces = false, const WriteOptions &options = WriteOptions()) const
+   {
+      details::Serializer<char_t, TSink> serializer(&sink, options);
+      if (namespaces) {
+         details::AttrMap<char_t> inherited = details::InheritedNamespaces(*pdata_);
+         serializer.WriteElement(*pdata_, 0, &inherited);
+      }
+      else {
+         serializer.WriteElement(*pdata_);
+      }
+   }
+   // Serialize the element and its children to xml into a stream
+   void WriteTo(std::basic_ostream<char_t> &out, bool namespaces = false,
+                const WriteOptions &options = WriteOptions()) const
+   {
+      OStreamSink<char_t> sink(&out);
+      Serialize(sink, namespaces, options);
+   }
+#ifdef XMLPARSER_POSIX
+   // Serialize the element and its children to xml into a file descriptor. Throws xml::Exception if writing
+   // fails.
+   void WriteTo(int fd, bool namespaces = false, const WriteOptions &options = WriteOptions()) const
+   {
+      FdSink<char_t> sink(fd);
+      Serialize(sink, namespaces, options);
+      sink.Flush();
+   }
+#endif
+
    friend std::basic_ostream<char_t> &operator<<(std::basic_ostream<char_t> &out, const my_t &e);
 
 private:
-   const std::pair<const std::basic_string<char_t>, std::basic_string<char_t>> &GetAttr(std::size_t index) const
+   const typename details::AttrMap<char_t>::value_type &GetAttr(std::size_t index) const
    {
       auto it = pdata_->attrs.cbegin();
       for (std::size_t i = 0; i < index; ++i) {
@@ -688,36 +3632,47 @@ public:
    typedef Document<char_t> my_t;
 
    // Parse 'text'
-   Document(const char_t *text, bool replace_er)
+   Document(const char_t *text, bool replace_er) : Document(text, MakeOptions(replace_er))
+   {}
+   // Parse 'text'
+   Document(const char_t *text, const ParseOptions &options)
    {
-      std::list<const char_t *> tokens = details::Tokenize(text);
-      details::RemoveGaps(&tokens);
-      details::RemoveInsideComments(&tokens);
-      details::RemoveLeadingComments(&tokens);
-
-      const char_t *pfirst = *tokens.begin();
-      if (*pfirst != (char_t)'<') {
-         throw Exception("Malformed beginning");
+      if (options.keep_source) {
+         std::size_t length = std::char_traits<char_t>::length(text);
+         source_.reset(new char_t[length + 1]);
+         std::char_traits<char_t>::copy(source_.get(), text, length + 1);
+         text = source_.get();
       }
-      if (*(pfirst + 1) == (char_t)'?') { // has declaration
-         auto declaration = details::ExtractAttributes(pfirst, *(++tokens.begin()));
-
-         const std::basic_string<char_t> *decl_attrs = details::DeclarationAttrs<char_t>();
-         std::basic_string<char_t> *decl_data[]      = {&version_, &encoding_, &standalone_};
-
-         for (int i = 0; i < 3; ++i) {
-            auto it = declaration.find(decl_attrs[i]);
-            if (it != declaration.cend()) {
-               *(decl_data[i]) = it->second;
-            }
-         }
-         tokens.pop_front();
-         details::RemoveLeadingComments(&tokens);
+      Parse(text, options);
+   }
+   // Parse the contents of 'file', decoded from UTF-8 for wide characters. The file is kept only if elements
+   // refer to it, see ParseOptions::keep_source and xml::ParseFile().
+   Document(details::MappedFile file, const ParseOptions &options)
+   {
+      const char *ptext = file.Text();
+      std::size_t size  = file.Size();
+      if (size >= 3 && std::memcmp(ptext, "\xEF\xBB\xBF", 3) == 0) {
+         // Byte order mark
+         ptext += 3;
+         size -= 3;
       }
-      proot_ = details::BuildElementTree(tokens, replace_er);
-      if (!proot_) {
-         throw Exception("Malformed xml");
+      if constexpr (sizeof(char_t) == 1) {
+         file_ = std::move(file);
+         Parse(reinterpret_cast<const char_t *>(ptext), options);
+         if (!proot_->source_begin)
+            file_.Reset();
       }
+      else {
+         std::unique_ptr<char_t[]> text(new char_t[size + 1]);
+         *details::DecodeUtf8(ptext, size, text.get()) = 0;
+         file.Reset();
+         ParseOwned(std::move(text), options);
+      }
+   }
+   // Parse null-terminated 'text', which is kept only if elements refer to it, see ParseOptions::keep_source
+   Document(std::unique_ptr<char_t[]> text, const ParseOptions &options)
+   {
+      ParseOwned(std::move(text), options);
    }
    // Create new empty document
    Document(std::basic_string<char_t> root_name, std::basic_string<char_t> version, std::basic_string<char_t> encoding,
@@ -734,6 +3689,12 @@ public:
    Document(const my_t &) = delete;
    my_t &operator=(const my_t &) = delete;
 
+   // Take ownership of an element tree
+   Document(std::unique_ptr<details::ElementData<char_t>> proot, std::basic_string<char_t> version,
+            std::basic_string<char_t> encoding, std::basic_string<char_t> standalone)
+       : proot_(std::move(proot)), version_(std::move(version)), encoding_(std::move(encoding)),
+         standalone_(std::move(standalone))
+   {}
    // Create a deep non-const copy of the document
    std::unique_ptr<my_t> Copy() const
    {
@@ -743,27 +3704,127 @@ public:
       return pcopy;
    }
    // Serialize to xml
-   std::basic_string<char_t> ToString() const
+   std::basic_string<char_t> ToString(const WriteOptions &options = WriteOptions()) const
    {
-      using details::Markup;
-      using details::MarkupTable;
-
-      std::basic_ostringstream<char_t> out;
-      if (!(version_.empty() && encoding_.empty() && standalone_.empty())) {
-         out << MarkupTable<char_t>(Markup::DECL_START);
-
-         const std::basic_string<char_t> *decl_attrs  = details::DeclarationAttrs<char_t>();
-         const std::basic_string<char_t> *decl_data[] = {&version_, &encoding_, &standalone_};
-         for (int i = 0; i < 3; ++i) {
-            if (!decl_data[i]->empty())
-               out << MarkupTable<char_t>(Markup::ATTR_START) << decl_attrs[i] << MarkupTable<char_t>(Markup::ATTR_MID)
-                   << *(decl_data[i]) << MarkupTable<char_t>(Markup::ATTR_END);
-         }
-         out << MarkupTable<char_t>(Markup::DECL_END);
+      std::basic_string<char_t> out;
+      ToString(out, options);
+      return out;
+   }
+   // Serialize to xml into 'out', replacing its content. Reuses the capacity of 'out', so that repeated calls
+   // with the same string don't reallocate.
+   void ToString(std::basic_string<char_t> &out, const WriteOptions &options = WriteOptions()) const
+   {
+      out.clear();
+      std::size_t threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+      if (threads > 1 && !options.pretty && SerializedSize() >= options.parallel_min_size) {
+         out.resize(SerializedSize());
+         details::PointerSink<char_t> sink{&out[0]};
+         details::Serializer<char_t, details::PointerSink<char_t>>(&sink).WriteDeclaration(version_, encoding_,
+                                                                                           standalone_);
+         details::SerializeParallel(*proot_, sink.pos, threads);
+         return;
+      }
+      out.reserve(SerializedSize()); // exact unless pretty-printing
+      StringSink<char_t> sink(&out);
+      Serialize(sink, options);
+   }
+   // Serialize to UTF-8 encoded xml, converting wide characters on the fly without an intermediate wide string.
+   // The encoding in the declaration is written as it is.
+   std::string ToUtf8(const WriteOptions &options = WriteOptions()) const
+   {
+      std::string out;
+      ToUtf8(out, options);
+      return out;
+   }
+   // Same as ToUtf8(), but replaces the content of 'out' and reuses its capacity
+   void ToUtf8(std::string &out, const WriteOptions &options = WriteOptions()) const
+   {
+      out.clear();
+      out.reserve(SerializedSize()); // exact for ascii unless pretty-printing
+      StringSink<char> bytes(&out);
+      Utf8Sink<char_t, StringSink<char>> sink(&bytes);
+      Serialize(sink, options);
+      sink.Finish();
+   }
+   // Length of the output of ToString() with default options, without producing it
+   std::size_t SerializedSize() const
+   {
+      return details::DeclarationSize(version_, encoding_, standalone_) + details::SerializedSize(*proot_);
+   }
+   // Serialize to xml into any sink, see xml::StringSink
+   template <typename TSink>
+   void Serialize(TSink &sink, const WriteOptions &options = WriteOptions()) const
+   {
+      details::Serializer<char_t, TSink> serializer(&sink, options);
+      serializer.WriteDeclaration(version_, encoding_, standalone_);
+      serializer.WriteElement(*proot_);
+   }
+   // Serialize to Canonical XML 1.0 into any sink. The declaration is omitted, see details::CanonicalSerializer
+   // for the rules.
+   template <typename TSink>
+   void SerializeCanonical(TSink &sink) const
+   {
+      details::CanonicalSerializer<char_t, TSink>(&sink).WriteElement(*proot_);
+   }
+   // Serialize to Canonical XML 1.0
+   std::basic_string<char_t> ToCanonicalString() const
+   {
+      std::basic_string<char_t> out;
+      {
+         StringSink<char_t> sink(&out);
+         SerializeCanonical(sink);
       }
-      out << *proot_;
-      return out.str();
+      return out;
+   }
+   // SHA-256 digest of the UTF-8 encoded Canonical XML, computed without building the output. Equal digests
+   // mean logically equal documents.
+   std::array<unsigned char, 32> CanonicalDigest() const
+   {
+      Sha256Sink<char_t> sink;
+      SerializeCanonical(sink);
+      return sink.Digest();
+   }
+   // Encode to the compact binary format read by xml::ParseBinary()
+   std::string ToBinary() const
+   {
+      std::string out;
+      ToBinary(out);
+      return out;
+   }
+   // Same as ToBinary(), but replaces the content of 'out' and reuses its capacity
+   void ToBinary(std::string &out) const
+   {
+      const std::basic_string<char_t> *declaration[] = {&version_, &encoding_, &standalone_};
+      out.clear();
+      details::BinaryEncoder<char_t>().Encode(*proot_, declaration, &out);
+   }
+   // Saves the document as a binary image that can be loaded with xml::LoadSnapshot(). Throws xml::Exception
+   // if the file cannot be written.
+   void SaveSnapshot(const std::string &path) const
+   {
+      const std::basic_string<char_t> *declaration[] = {&version_, &encoding_, &standalone_};
+      std::string image = details::SnapshotBuilder<char_t>().Build(*proot_, declaration);
+
+      std::ofstream file(path, std::ios::binary | std::ios::trunc);
+      if (!file.write(image.data(), static_cast<std::streamsize>(image.size())) || !file.flush())
+         throw Exception("Failed to write snapshot " + path);
+   }
+   // Serialize to xml into a stream without building the whole output in memory
+   void WriteTo(std::basic_ostream<char_t> &out, const WriteOptions &options = WriteOptions()) const
+   {
+      OStreamSink<char_t> sink(&out);
+      Serialize(sink, options);
+   }
+#ifdef XMLPARSER_POSIX
+   // Serialize to xml into a file descriptor without building the whole output in memory. Throws xml::Exception
+   // if writing fails.
+   void WriteTo(int fd, const WriteOptions &options = WriteOptions()) const
+   {
+      FdSink<char_t> sink(fd);
+      Serialize(sink, options);
+      sink.Flush();
    }
+#endif
 
    const std::basic_string<char_t> &GetVersion() const noexcept
    {
@@ -802,6 +3863,44 @@ public:
    }
 
 private:
+   // 'text' must outlive the document if ParseOptions::keep_source is set
+   void Parse(const char_t *text, const ParseOptions &options)
+   {
+      details::Prolog<char_t> prolog;
+      const char_t *pfirst = details::ParseProlog(text, &prolog);
+      if (!pfirst) {
+         throw Exception("Malformed prolog");
+      }
+      if (*pfirst != (char_t)'<') {
+         throw Exception("Malformed beginning");
+      }
+      details::ExtractDeclaration(prolog, &version_, &encoding_, &standalone_);
+      std::list<const char_t *> tokens = details::Tokenize(pfirst);
+      details::RemoveGaps(&tokens);
+      details::RemoveInsideComments(&tokens);
+
+      proot_ = details::BuildElementTree(tokens, options, prolog.entities);
+      if (!proot_) {
+         throw Exception("Malformed xml");
+      }
+   }
+
+   void ParseOwned(std::unique_ptr<char_t[]> text, const ParseOptions &options)
+   {
+      Parse(text.get(), options);
+      if (proot_->source_begin)
+         source_ = std::move(text);
+   }
+
+   static ParseOptions MakeOptions(bool replace_er)
+   {
+      ParseOptions options;
+      options.entity_references = replace_er;
+      return options;
+   }
+
+   std::unique_ptr<char_t[]> source_; // see ParseOptions::keep_source, elements refer to it
+   details::MappedFile file_;         // same as 'source_' for files parsed in place
    std::unique_ptr<details::ElementData<char_t>> proot_;
    std::basic_string<char_t> version_;
    std::basic_string<char_t> encoding_;
@@ -841,21 +3940,548 @@ inline std::unique_ptr<const Document<TChar>> ParseString(const std::basic_strin
    return std::make_unique<const Document<TChar>>(text.c_str(), entity_references);
 }
 
-// Reads data from 'stream' into cache and parses it into an xml::Document. Lower performance than
-// the other overloads. Parsing entity references might slow down the process, set entity_references
-// to 'false' if that is undesirable.
+// Creates xml::Document that reads and parses 'text' according to 'options'.
+template <typename TChar>
+inline std::unique_ptr<const Document<TChar>> ParseString(const TChar *text, const ParseOptions &options)
+{
+   return std::make_unique<const Document<TChar>>(text, options);
+}
+
+// Creates xml::Document that reads and parses 'text' according to 'options'.
+template <typename TChar>
+inline std::unique_ptr<const Document<TChar>> ParseString(const std::basic_string<TChar> &text,
+                                                          const ParseOptions &options)
+{
+   return std::make_unique<const Document<TChar>>(text.c_str(), options);
+}
+
+// Reads the rest of 'stream' into one buffer, see details::ReadStream(), and parses it into an xml::Document
+// according to 'options'. Files are parsed faster by xml::ParseFile().
+template <typename TChar>
+std::unique_ptr<const Document<TChar>> ParseStream(std::basic_istream<TChar> &stream, const ParseOptions &options)
+{
+   return std::make_unique<const Document<TChar>>(details::ReadStream(stream), options);
+}
+
+// Reads the rest of 'stream' into one buffer and parses it into an xml::Document, same as above. Parsing entity
+// references might slow down the process, set entity_references to 'false' if that is undesirable.
 template <typename TChar>
 std::unique_ptr<const Document<TChar>> ParseStream(std::basic_istream<TChar> &stream, bool entity_references = true)
 {
-   constexpr std::size_t SIZE = 4096;
-   std::basic_string<TChar> s;
-   TChar buf[SIZE];
+   ParseOptions options;
+   options.entity_references = entity_references;
+   return ParseStream(stream, options);
+}
+
+// Maps the file at 'path' into memory and parses it in place, without copying it through a stream. The mapping is
+// kept by the document only with ParseOptions::keep_source. Wide characters are decoded from UTF-8. Throws
+// xml::Exception if 'path' isn't a regular file that can be read, use xml::ParseStream() for pipes.
+template <typename TChar = char>
+std::unique_ptr<const Document<TChar>> ParseFile(const std::string &path, const ParseOptions &options)
+{
+   return std::make_unique<const Document<TChar>>(details::MappedFile(path), options);
+}
+
+// Same as above. Parsing entity references might slow down the process, set entity_references to 'false' if that
+// is undesirable.
+template <typename TChar = char>
+std::unique_ptr<const Document<TChar>> ParseFile(const std::string &path, bool entity_references = true)
+{
+   ParseOptions options;
+   options.entity_references = entity_references;
+   return ParseFile<TChar>(path, options);
+}
+
+// Parses xml that arrives in fragments, e.g. from a socket, building the tree while the text is still coming in.
+// Only the token that isn't complete yet is kept between calls to Feed(), so tags, comments, entity references and
+// attribute values may be split anywhere. The result is the same as that of xml::ParseString() on the concatenated
+// text, except that ParseOptions::keep_source is ignored, since the text doesn't outlive the parser.
+template <typename TChar>
+class PushParser
+{
+public:
+   typedef TChar char_t;
+
+   explicit PushParser(const ParseOptions &options = ParseOptions()) : options_(options)
+   {
+      options_.keep_source = false;
+   }
+   PushParser(const PushParser &) = delete;
+   PushParser &operator=(const PushParser &) = delete;
+
+   // Parses as much of the 'size' symbols at 'data' as possible, the rest is kept for the next call. Throws
+   // xml::Exception if the text is malformed, call Reset() before feeding the parser again in that case.
+   void Feed(const char_t *data, std::size_t size)
+   {
+      if (Complete())
+         return;
+      pending_.append(data, size);
+      // Everything in the prolog ends with a '>', so there is nothing new to parse until one comes in
+      if (!pbuilder_ && (std::find(data, data + size, (char_t)'>') == data + size || !StartBody(false)))
+         return;
+      ParseTokens(false);
+   }
+   // Whether the root element has been closed. Text fed after that is ignored.
+   bool Complete() const noexcept
+   {
+      return pbuilder_ && pbuilder_->Complete();
+   }
+   // Parses what is left and returns the document. The parser is reset for the next document, also if
+   // xml::Exception is thrown because the text is malformed.
+   std::unique_ptr<const Document<char_t>> Finish()
+   {
+      std::unique_ptr<details::ElementData<char_t>> proot;
+      try {
+         if (!pbuilder_)
+            StartBody(true);
+         ParseTokens(true);
+         if (in_comment_) {
+            // An unterminated comment ends only its own token, the rest is parsed as usual
+            begin_      = comment_begin_;
+            pos_        = begin_ + 1;
+            end_        = NONE;
+            in_comment_ = false;
+            comments_   = false;
+            ParseTokens(true);
+         }
+         proot = pbuilder_->Release();
+      }
+      catch (...) {
+         Reset();
+         throw;
+      }
+      auto pdoc = std::make_unique<const Document<char_t>>(std::move(proot), std::move(version_),
+                                                           std::move(encoding_), std::move(standalone_));
+      Reset();
+      return pdoc;
+   }
+   // Discards everything fed so far
+   void Reset()
+   {
+      pbuilder_.reset();
+      pprolog_.reset();
+      pending_.clear();
+      version_.clear();
+      encoding_.clear();
+      standalone_.clear();
+      tag_quote_  = 0;
+      begin_      = 0;
+      pos_        = 0;
+      end_        = NONE;
+      has_root_   = false;
+      in_comment_ = false;
+      comments_   = true;
+   }
+
+private:
+   static constexpr std::size_t NONE = static_cast<std::size_t>(-1);
+
+   // Parses the prolog, see details::ParseProlog(), and drops it from 'pending_'. Returns false if the prolog or
+   // the start tag of the root element may be incomplete, unless it's the 'last' chance.
+   bool StartBody(bool last)
+   {
+      const char_t *ptext  = pending_.c_str();
+      auto pprolog         = std::make_unique<details::Prolog<char_t>>();
+      const char_t *pfirst = details::ParseProlog(ptext, pprolog.get());
+      if (!last && (!pfirst || !*pfirst))
+         return false;
+      if (!pfirst) {
+         throw Exception("Malformed prolog");
+      }
+      if (*pfirst != (char_t)'<') {
+         throw Exception("Malformed beginning");
+      }
+      // "<!--", "<?" and "<!DOCTYPE" have no '>', so the root can't be a prefix of them once it has one
+      if (!last && pending_.find((char_t)'>', pfirst - ptext) == std::basic_string<char_t>::npos)
+         return false;
+
+      details::ExtractDeclaration(*pprolog, &version_, &encoding_, &standalone_);
+      pprolog_  = std::move(pprolog);
+      pbuilder_ = std::make_unique<details::TreeBuilder<char_t>>(options_, pprolog_->entities, false);
+      pending_.erase(0, pfirst - ptext);
+      return true;
+   }
+   // Splits 'pending_' into tokens like details::Tokenize(), details::RemoveGaps() and
+   // details::RemoveInsideComments() do and adds them to the tree. A token is complete once the next one has
+   // started, or at the end of the text if it's the 'last' call. Drops the text of the added tokens.
+   void ParseTokens(bool last)
+   {
+      const char_t *ptext = pending_.c_str();
+      std::size_t size    = pending_.size();
+
+      while (begin_ < size && !pbuilder_->Complete()) {
+         if (end_ == NONE) {
+            // Whether the token is a tag depends on the symbol behind its '<'
+            if (begin_ + 1 == size && !last)
+               break;
+            if (details::IsTagStart(ptext + begin_)) {
+               // Tags end behind their '>', skipping quoted attribute values, see details::Tokenize()
+               const char_t *pit = ptext + std::max(pos_, begin_ + 1);
+               std::size_t pos   = details::FindTagEnd(pit, ptext + size, &tag_quote_) - ptext;
+               pos_              = pos;
+               if (pos == size && !last)
+                  break;
+               if (pos < size && ptext[pos] == (char_t)'>')
+                  ++pos;
+               tag_quote_ = 0;
+               AddToken(begin_, pos);
+               continue;
+            }
+            // Other tokens end before a '<' or behind a '>'
+            std::size_t pos = std::max(pos_, begin_ + 1);
+            while (pos < size && ptext[pos] != (char_t)'<' && ptext[pos - 1] != (char_t)'>')
+               ++pos;
+            pos_ = pos;
+            if (pos == size && ptext[pos - 1] != (char_t)'>' && !last)
+               break;
+            if (ptext[begin_] == (char_t)'<') {
+               // Whitespaces behind a tag don't change it, so it's added without waiting for them
+               AddToken(begin_, pos);
+               continue;
+            }
+            if (ptext[pos - 1] != (char_t)'>') {
+               if (std::all_of(ptext + begin_, ptext + pos, details::IsSpace<char_t>))
+                  begin_ = pos; // gap between tags
+               else
+                  AddToken(begin_, pos);
+               continue;
+            }
+            end_ = pos;
+         }
+         // Whitespaces between a '>' and the next '<' belong to the text in front of them
+         while (pos_ < size && details::IsSpace(ptext[pos_]))
+            ++pos_;
+         if (pos_ == size && !last)
+            break;
+         std::size_t end = pos_ == size || ptext[pos_] == (char_t)'<' ? pos_ : end_;
+         end_            = NONE;
+         AddToken(begin_, end);
+      }
+
+      std::size_t done = in_comment_ ? comment_begin_ : begin_;
+      pending_.erase(0, done);
+      begin_ -= done;
+      pos_ = pos_ > done ? pos_ - done : 0;
+      if (end_ != NONE)
+         end_ -= done;
+      if (in_comment_)
+         comment_begin_ -= done;
+   }
+   // Adds the token [pbegin, pend) of 'pending_' to the tree, unless it's inside a comment that hasn't ended yet
+   void AddToken(std::size_t pbegin, std::size_t pend)
+   {
+      const char_t *ptext = pending_.c_str();
+      begin_              = pend;
+      if (comments_) {
+         for (const char_t *pit = ptext + pbegin; pit < ptext + pend; ++pit) {
+            if (!in_comment_ && details::IsCommentStart(pit)) {
+               in_comment_    = true;
+               comment_begin_ = pbegin;
+               pit += 3; // IsCommentStart() checks next 3 symbols
+            }
+            else if (in_comment_ && details::IsCommentEnd(pit)) {
+               in_comment_ = false;
+               pbegin      = comment_begin_;
+               break;
+            }
+         }
+         if (in_comment_)
+            return;
+      }
+      if (!has_root_) {
+         pbuilder_->AddRoot(ptext + pbegin, ptext + pend);
+         has_root_ = true;
+      }
+      else if (!pbuilder_->AddToken(ptext + pbegin, ptext + pend)) {
+         throw Exception("Malformed xml");
+      }
+   }
+
+   ParseOptions options_;
+   std::unique_ptr<details::Prolog<char_t>> pprolog_;        // entities from the DTD, referred to by the builder
+   std::unique_ptr<details::TreeBuilder<char_t>> pbuilder_; // set once the prolog has been parsed
+   std::basic_string<char_t> pending_;                      // text that hasn't been added to the tree yet
+   std::basic_string<char_t> version_;
+   std::basic_string<char_t> encoding_;
+   std::basic_string<char_t> standalone_;
+   // Positions in 'pending_': start of the next token, how far its end has been searched for, and its end
+   // behind a '>' if it's followed by whitespaces only so far
+   std::size_t begin_         = 0;
+   std::size_t pos_           = 0;
+   std::size_t end_           = NONE;
+   std::size_t comment_begin_ = 0;
+   bool has_root_             = false;
+   bool in_comment_           = false;
+   bool comments_             = true; // false once a comment turned out to be unterminated
+   char_t tag_quote_          = 0;    // see details::FindTagEnd(), for the tag at 'begin_'
+};
+
+// Decodes a document encoded by Document::ToBinary(). Throws xml::Exception if the data is malformed or was
+// encoded from a document with a different character type.
+template <typename TChar>
+std::unique_ptr<const Document<TChar>> ParseBinary(const char *data, std::size_t size)
+{
+   std::basic_string<TChar> declaration[3];
+   auto proot = details::BinaryDecoder<TChar>(data, size).Decode(declaration);
+   return std::make_unique<const Document<TChar>>(std::move(proot), std::move(declaration[0]),
+                                                  std::move(declaration[1]), std::move(declaration[2]));
+}
+
+template <typename TChar>
+std::unique_ptr<const Document<TChar>> ParseBinary(const std::string &data)
+{
+   return ParseBinary<TChar>(data.data(), data.size());
+}
+
+template <typename TChar>
+class Snapshot;
+
+// Read-only element of a snapshot, see xml::Snapshot. Strings refer to the snapshot's memory.
+template <typename TChar>
+class SnapshotElement
+{
+public:
+   typedef TChar char_t;
+   typedef std::basic_string_view<char_t> view_t;
+
+   view_t GetName() const noexcept
+   {
+      return psnapshot_->String(pnode_->name);
+   }
+   view_t GetContent() const noexcept
+   {
+      return psnapshot_->String(pnode_->content);
+   }
+
+   std::size_t GetAttributeCount() const noexcept
+   {
+      return pnode_->attr_count;
+   }
+   view_t GetAttributeName(std::size_t index) const
+   {
+      return psnapshot_->String(GetAttr(index).name);
+   }
+   view_t GetAttributeValue(std::size_t index) const
+   {
+      return psnapshot_->String(GetAttr(index).value);
+   }
+   // Binary search, attributes are sorted by name
+   view_t GetAttributeValue(view_t name) const
+   {
+      const details::SnapshotAttr *pbegin = psnapshot_->attrs_ + pnode_->first_attr;
+      const details::SnapshotAttr *pend   = pbegin + pnode_->attr_count;
+      auto it = std::lower_bound(pbegin, pend, name, [this](const details::SnapshotAttr &attr, view_t key) {
+         return psnapshot_->String(attr.name) < key;
+      });
+      if (it == pend || psnapshot_->String(it->name) != name) {
+         throw Exception("Attribute " + details::Narrow(name) + " not found");
+      }
+      return psnapshot_->String(it->value);
+   }
+
+   std::size_t GetChildCount() const noexcept
+   {
+      return pnode_->child_count;
+   }
+   SnapshotElement GetChild(std::size_t index) const
+   {
+      if (index >= pnode_->child_count) {
+         throw Exception("Child " + std::to_string(index) +
+                         " not found, child count = " + std::to_string(pnode_->child_count));
+      }
+      return SnapshotElement(psnapshot_, psnapshot_->nodes_ + pnode_->first_child + index);
+   }
+   SnapshotElement GetChild(view_t name) const
+   {
+      for (std::uint32_t i = 0; i < pnode_->child_count; ++i) {
+         const details::SnapshotNode *pchild = psnapshot_->nodes_ + pnode_->first_child + i;
+         if (psnapshot_->String(pchild->name) == name) {
+            return SnapshotElement(psnapshot_, pchild);
+         }
+      }
+      throw Exception("Child " + details::Narrow(name) + " not found");
+   }
+
+private:
+   friend class Snapshot<char_t>;
+
+   SnapshotElement(const Snapshot<char_t> *psnapshot, const details::SnapshotNode *pnode) noexcept
+       : psnapshot_(psnapshot), pnode_(pnode)
+   {}
+   const details::SnapshotAttr &GetAttr(std::size_t index) const
+   {
+      if (index >= pnode_->attr_count) {
+         throw Exception("Attribute " + std::to_string(index) + " not found");
+      }
+      return psnapshot_->attrs_[pnode_->first_attr + index];
+   }
+
+   const Snapshot<char_t> *psnapshot_;
+   const details::SnapshotNode *pnode_;
+};
+
+// Document loaded from a binary image created by Document::SaveSnapshot(). The image is mapped into memory
+// and queried in place, so loading takes time proportional to the number of elements and attributes only for
+// validation, not to the size of the text. The checksum of the whole image is only verified on request, it
+// detects changed text as well. Elements stay valid as long as the snapshot exists.
+template <typename TChar>
+class Snapshot
+{
+public:
+   typedef TChar char_t;
+   typedef std::basic_string_view<char_t> view_t;
+
+   // Throws xml::Exception if the file cannot be read or isn't a valid snapshot of a document of 'TChar'.
+   // Callers can then fall back to parsing the xml.
+   explicit Snapshot(const std::string &path, bool verify_checksum = false)
+   {
+      Map(path);
+      try {
+         Validate(verify_checksum);
+      }
+      catch (...) {
+         Unmap();
+         throw;
+      }
+   }
+   ~Snapshot()
+   {
+      Unmap();
+   }
+   Snapshot(const Snapshot &) = delete;
+   Snapshot &operator=(const Snapshot &) = delete;
+
+   SnapshotElement<char_t> GetRoot() const noexcept
+   {
+      return SnapshotElement<char_t>(this, nodes_);
+   }
+   view_t GetVersion() const noexcept
+   {
+      return String(header_->declaration[0]);
+   }
+   view_t GetEncoding() const noexcept
+   {
+      return String(header_->declaration[1]);
+   }
+   view_t GetStandalone() const noexcept
+   {
+      return String(header_->declaration[2]);
+   }
+
+private:
+   friend class SnapshotElement<char_t>;
+
+   void Map(const std::string &path)
+   {
+#ifdef XMLPARSER_POSIX
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+         throw Exception("Failed to open snapshot " + path);
+      struct stat info;
+      if (::fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(details::SnapshotHeader))) {
+         ::close(fd);
+         throw Exception("Invalid snapshot " + path);
+      }
+      size_ = static_cast<std::size_t>(info.st_size);
+      void *paddr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (paddr == MAP_FAILED)
+         throw Exception("Failed to map snapshot " + path);
+      pimage_ = static_cast<const char *>(paddr);
+#else
+      std::ifstream file(path, std::ios::binary | std::ios::ate);
+      if (!file)
+         throw Exception("Failed to open snapshot " + path);
+      size_ = static_cast<std::size_t>(file.tellg());
+      buffer_.reset(new std::uint64_t[(size_ + 7) / 8]);
+      file.seekg(0);
+      if (size_ < sizeof(details::SnapshotHeader) || !file.read(reinterpret_cast<char *>(buffer_.get()), size_))
+         throw Exception("Invalid snapshot " + path);
+      pimage_ = reinterpret_cast<const char *>(buffer_.get());
+#endif
+   }
+   void Unmap() noexcept
+   {
+#ifdef XMLPARSER_POSIX
+      ::munmap(const_cast<char *>(pimage_), size_);
+#endif
+   }
+   // Checks the header, that every reference stays inside the image and that attributes are sorted, so that
+   // queries need no checks. Reads the whole image only to 'verify_checksum'.
+   void Validate(bool verify_checksum)
+   {
+      header_ = reinterpret_cast<const details::SnapshotHeader *>(pimage_);
+      if (std::memcmp(header_->magic, details::SNAPSHOT_MAGIC, sizeof(header_->magic)) != 0)
+         throw Exception("Not a snapshot");
+      if (header_->version != details::SNAPSHOT_VERSION || header_->char_size != sizeof(char_t))
+         throw Exception("Unsupported snapshot version");
+      if (header_->size != size_ || size_ % 8 != 0)
+         throw Exception("Snapshot is corrupted");
+      if (verify_checksum &&
+          header_->checksum != details::SnapshotChecksum(pimage_ + sizeof(*header_), size_ - sizeof(*header_)))
+         throw Exception("Snapshot is corrupted");
+
+      const std::uint64_t nodes_end = header_->nodes + std::uint64_t(header_->node_count) * sizeof(*nodes_);
+      const std::uint64_t attrs_end = header_->attrs + std::uint64_t(header_->attr_count) * sizeof(*attrs_);
+      if (header_->node_count == 0 || header_->nodes != sizeof(*header_) || header_->attrs != nodes_end ||
+          header_->strings != attrs_end || header_->strings > size_)
+         throw Exception("Snapshot is corrupted");
+
+      nodes_        = reinterpret_cast<const details::SnapshotNode *>(pimage_ + header_->nodes);
+      attrs_        = reinterpret_cast<const details::SnapshotAttr *>(pimage_ + header_->attrs);
+      strings_      = reinterpret_cast<const char_t *>(pimage_ + header_->strings);
+      string_count_ = (size_ - header_->strings) / sizeof(char_t);
+
+      auto check_string = [this](const details::SnapshotString &str) {
+         if (std::uint64_t(str.offset) + str.length > string_count_)
+            throw Exception("Snapshot is corrupted");
+      };
+      for (const auto &str : header_->declaration)
+         check_string(str);
+      for (std::uint32_t i = 0; i < header_->attr_count; ++i) {
+         check_string(attrs_[i].name);
+         check_string(attrs_[i].value);
+      }
+      for (std::uint32_t i = 0; i < header_->node_count; ++i) {
+         const details::SnapshotNode &node = nodes_[i];
+         check_string(node.name);
+         check_string(node.content);
+         if (std::uint64_t(node.first_attr) + node.attr_count > header_->attr_count ||
+             std::uint64_t(node.first_child) + node.child_count > header_->node_count ||
+             (node.child_count > 0 && node.first_child <= i))
+            throw Exception("Snapshot is corrupted");
+         // Lookup by name is a binary search
+         const details::SnapshotAttr *pattrs = attrs_ + node.first_attr;
+         for (std::uint32_t j = 1; j < node.attr_count; ++j) {
+            if (!(String(pattrs[j - 1].name) < String(pattrs[j].name)))
+               throw Exception("Snapshot is corrupted");
+         }
+      }
+   }
+   view_t String(const details::SnapshotString &str) const noexcept
+   {
+      return view_t(strings_ + str.offset, str.length);
+   }
 
-   while (stream.read(buf, SIZE))
-      s.append(buf, SIZE);
-   s.append(buf, stream.gcount());
+   const char *pimage_ = nullptr;
+   std::size_t size_   = 0;
+#ifndef XMLPARSER_POSIX
+   std::unique_ptr<std::uint64_t[]> buffer_; // 8-byte aligned copy of the file
+#endif
+   const details::SnapshotHeader *header_ = nullptr;
+   const details::SnapshotNode *nodes_    = nullptr;
+   const details::SnapshotAttr *attrs_    = nullptr;
+   const char_t *strings_                 = nullptr;
+   std::size_t string_count_              = 0;
+};
 
-   return std::make_unique<const Document<TChar>>(s.c_str(), entity_references);
+// Loads a snapshot saved by Document::SaveSnapshot(). Throws xml::Exception if 'path' isn't a valid snapshot,
+// in which case the xml can be parsed instead. With 'verify_checksum' the whole image is read to detect changes
+// that leave it well-formed, such as changed text.
+template <typename TChar>
+std::unique_ptr<const Snapshot<TChar>> LoadSnapshot(const std::string &path, bool verify_checksum = false)
+{
+   return std::make_unique<const Snapshot<TChar>>(path, verify_checksum);
 }
 
 } // namespace xml